@@ -11,6 +11,7 @@
 #define JSON_BUFFER_LENGTH 150
 #define ONE_WIRE_BUS 14
 #define TX_PIN 4
+#define RX_PIN 12
 #define HALL_PIN 5
 #define DEBUG 1
 
@@ -18,6 +19,18 @@
 #define TX_CMD_CLOSE "FQ0F00Q101011F0F0101"
 #define TX_CMD_STOP  "FQ0F00Q101011F0FFFFF"
 
+// tags of the queued transmissions
+#define TX_OPEN 1
+#define TX_CLOSE 2
+#define TX_STOP 3
+#define TX_LEARNED 4
+
+// commands learned from the original remote are kept in SPIFFS
+#define MAX_LEARNED 8
+#define NAME_SIZE 12
+#define LEARNED_DIR "/rf/"
+#define LEARN_TIMEOUT 30000
+
 const char publishTopic[] = "events/" DEVICE_ID; // publish events here
 const char cmdTopic[] = "cmd/" DEVICE_ID;        // subscribe for commands here
 const char AWS_endpoint[] = AWS_PREFIX ".iot.eu-west-1.amazonaws.com";
@@ -31,9 +44,23 @@ PubSubClient client(AWS_endpoint, 8883, callback, espClient);
 CRCSwitch mySwitch = CRCSwitch();
 OneWire oneWire(ONE_WIRE_BUS);
 DallasTemperature sensor(&oneWire);
+CRCSwitchCode openCode;
+CRCSwitchCode closeCode;
+CRCSwitchCode stopCode;
 unsigned long lastHeartBeat = 0;
 boolean lastIsClosed = true;
 
+struct LearnedCommand {
+  char name[NAME_SIZE];
+  CRCSwitchCode code;
+};
+
+LearnedCommand learned[MAX_LEARNED];
+byte learnedCount = 0;
+char learningName[NAME_SIZE];
+unsigned long learnStart = 0;
+boolean sniffing = false;
+
 void setup() {
   Serial.begin(115200);
   Serial.setDebugOutput(true);
@@ -98,6 +125,18 @@ void setup() {
   mySwitch.enableTransmit(TX_PIN);
   mySwitch.setProtocol(4);
   mySwitch.setRepeatTransmit(10);
+  mySwitch.setTransmitCallback(transmitted);
+
+  // commands are compiled once and replayed from the cache
+  if (!mySwitch.compileQuadState(TX_CMD_OPEN, &openCode) ||
+      !mySwitch.compileQuadState(TX_CMD_CLOSE, &closeCode) ||
+      !mySwitch.compileQuadState(TX_CMD_STOP, &stopCode)) {
+    Serial.println("Failed to compile commands");
+  }
+  loadLearned();
+
+  // RX setup, for learning and sniffing
+  mySwitch.enableReceive(digitalPinToInterrupt(RX_PIN));
 
   pinMode(HALL_PIN, INPUT);
   pinMode(LED_BUILTIN, OUTPUT);
@@ -119,6 +158,8 @@ void loop() {
     reconnect();
   }
   client.loop();
+  mySwitch.handleTransmit();
+  handleReceive();
 
   if (lastIsClosed != isClosed) {
     float ta = poll();
@@ -199,8 +240,6 @@ float poll() {
 }
 
 boolean publish(boolean isClosed, float ta) {
-  boolean ret = true;
-
   StaticJsonBuffer<JSON_BUFFER_LENGTH> jsonBuffer;
   JsonObject& root = jsonBuffer.createObject();
   JsonObject& d = root.createNestedObject("d");
@@ -212,6 +251,43 @@ boolean publish(boolean isClosed, float ta) {
     d["STATE"] = "OPEN";
   }
 
+  return publishRoot(root);
+}
+
+// protocol is NULL when learning failed
+boolean publishLearned(const char* name, const CRCSwitchProtocol* protocol, const CRCSwitchCode* code) {
+  StaticJsonBuffer<JSON_BUFFER_LENGTH> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonObject& d = root.createNestedObject("d");
+
+  d["LEARNED"] = name;
+  if (protocol != NULL) {
+    d["PROTOCOL"] = protocol->nProtocol;
+    d["PULSE"] = code->nPulseLength;
+    d["PULSES"] = code->nPulses;
+  } else {
+    d["FAILED"] = true;
+  }
+
+  return publishRoot(root);
+}
+
+boolean publishSniffed(const CRCSwitchReceived* received) {
+  StaticJsonBuffer<JSON_BUFFER_LENGTH> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonObject& d = root.createNestedObject("d");
+
+  d["SNIFFED"] = received->nValue;
+  d["BITS"] = received->nBitlength;
+  d["PROTOCOL"] = received->nProtocol;
+  d["PULSE"] = received->nDelay;
+
+  return publishRoot(root);
+}
+
+boolean publishRoot(JsonObject& root) {
+  boolean ret = true;
+
   Serial.println("Publish payload:"); root.prettyPrintTo(Serial); Serial.println();
 
   char buff[JSON_BUFFER_LENGTH];
@@ -227,22 +303,37 @@ boolean publish(boolean isClosed, float ta) {
   return ret;
 }
 
+// transmissions are queued and sent from a timer interrupt,
+// WiFi and MQTT keep running meanwhile
 void openIt() {
   Serial.println("Transmitting OPEN.");
-  mySwitch.sendQuadState(TX_CMD_OPEN);
-  mySwitch.sendQuadState(TX_CMD_OPEN);
+  transmit(findCode("OPEN", &openCode), TX_OPEN);
 }
 
 void stopIt() {
   Serial.println("Transmitting STOP.");
-  mySwitch.sendQuadState(TX_CMD_STOP);
-  mySwitch.sendQuadState(TX_CMD_STOP);
+  transmit(findCode("STOP", &stopCode), TX_STOP);
 }
 
 void closeIt() {
   Serial.println("Transmitting CLOSE.");
-  mySwitch.sendQuadState(TX_CMD_CLOSE);
-  mySwitch.sendQuadState(TX_CMD_CLOSE);
+  transmit(findCode("CLOSE", &closeCode), TX_CLOSE);
+}
+
+// a learned command replaces the compiled one with the same name
+const CRCSwitchCode* findCode(const char* name, const CRCSwitchCode* compiled) {
+  LearnedCommand* command = findLearned(name);
+  return command != NULL ? &command->code : compiled;
+}
+
+void transmit(const CRCSwitchCode* code, int tag) {
+  if (!mySwitch.queueCode(code, tag) || !mySwitch.queueCode(code, tag)) {
+    Serial.println("Transmit queue full");
+  }
+}
+
+void transmitted(int tag) {
+  Serial.print("Transmitted "); Serial.println(tag);
 }
 
 void callback(char* topic, byte * payload, unsigned int length) {
@@ -271,6 +362,160 @@ void handleUpdate(byte * payload) {
       closeIt();
     } else if (d["CMD"] == "STOP") {
       stopIt();
+    } else if (d["CMD"] == "SEND") {
+      sendLearned(d["NAME"]);
+    } else if (d["CMD"] == "LEARN") {
+      startLearning(d["NAME"]);
+    } else if (d["CMD"] == "FORGET") {
+      forgetLearned(d["NAME"]);
+    } else if (d["CMD"] == "SNIFF") {
+      sniffing = d["ON"];
+      Serial.print("Sniffing "); Serial.println(sniffing);
+    }
+  }
+}
+
+// Learning mode: press a button of the original remote after the LEARN
+// command. The pulses are clustered to a code that is saved and replayed
+// like the compiled ones, so new blinds need no reflash.
+void handleReceive() {
+  // receive is off while transmitting, so is learning
+  if (mySwitch.isLearning() && !mySwitch.isTransmitting()) {
+    CRCSwitchCode code;
+    CRCSwitchProtocol protocol;
+    if (mySwitch.learn(&code, &protocol)) {
+      if (saveLearned(learningName, &code)) {
+        publishLearned(learningName, &protocol, &code);
+      } else {
+        publishLearned(learningName, NULL, NULL);
+      }
+    } else if (millis() - learnStart > LEARN_TIMEOUT) {
+      mySwitch.stopLearning();
+      Serial.println("Learning timed out");
+      publishLearned(learningName, NULL, NULL);
+    }
+  }
+
+  CRCSwitchReceived received;
+  while (mySwitch.receive(&received)) {
+    if (sniffing) {
+      publishSniffed(&received);
     }
   }
 }
+
+boolean isValidName(const char* name) {
+  if (name == NULL || name[0] == '\0' || strlen(name) >= NAME_SIZE) {
+    return false;
+  }
+
+  for (const char* c = name; *c != '\0'; c++) {
+    if (!isalnum(*c)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+LearnedCommand* findLearned(const char* name) {
+  for (byte i = 0; i < learnedCount; i++) {
+    if (strcmp(learned[i].name, name) == 0) {
+      return &learned[i];
+    }
+  }
+
+  return NULL;
+}
+
+void startLearning(const char* name) {
+  if (!isValidName(name)) {
+    Serial.println("Learn: invalid name");
+    return;
+  }
+
+  strcpy(learningName, name);
+  learnStart = millis();
+  mySwitch.startLearning();
+  Serial.print("Learning "); Serial.println(learningName);
+}
+
+void sendLearned(const char* name) {
+  LearnedCommand* command = isValidName(name) ? findLearned(name) : NULL;
+  if (command == NULL) {
+    Serial.println("Send: unknown command");
+    return;
+  }
+
+  Serial.print("Transmitting "); Serial.println(name);
+  transmit(&command->code, TX_LEARNED);
+}
+
+void loadLearned() {
+  learnedCount = 0;
+  Dir dir = SPIFFS.openDir(LEARNED_DIR);
+  while (dir.next() && learnedCount < MAX_LEARNED) {
+    String fileName = dir.fileName();
+    const char* name = fileName.c_str() + strlen(LEARNED_DIR);
+    if (!isValidName(name)) {
+      continue;
+    }
+
+    LearnedCommand* command = &learned[learnedCount];
+    File file = dir.openFile("r");
+    size_t length = file.read((uint8_t*)&command->code, sizeof(CRCSwitchCode));
+    file.close();
+    if (length != sizeof(CRCSwitchCode) || command->code.nPulses == 0 || command->code.nPulses > CRCSwitch_MAX_PULSES) {
+      Serial.print("Bad learned command "); Serial.println(name);
+      continue;
+    }
+
+    strcpy(command->name, name);
+    learnedCount++;
+    Serial.print("Loaded "); Serial.println(name);
+  }
+}
+
+boolean saveLearned(const char* name, const CRCSwitchCode* code) {
+  LearnedCommand* command = findLearned(name);
+  if (command == NULL) {
+    if (learnedCount >= MAX_LEARNED) {
+      Serial.println("Too many learned commands");
+      return false;
+    }
+    command = &learned[learnedCount];
+  }
+
+  String path = String(LEARNED_DIR) + name;
+  File file = SPIFFS.open(path, "w");
+  if (!file) {
+    Serial.println("Failed to open learned command file");
+    return false;
+  }
+  size_t length = file.write((const uint8_t*)code, sizeof(CRCSwitchCode));
+  file.close();
+  if (length != sizeof(CRCSwitchCode)) {
+    Serial.println("Failed to write learned command");
+    SPIFFS.remove(path);
+    return false;
+  }
+
+  if (command == &learned[learnedCount]) {
+    strcpy(command->name, name);
+    learnedCount++;
+  }
+  command->code = *code;
+  return true;
+}
+
+void forgetLearned(const char* name) {
+  LearnedCommand* command = isValidName(name) ? findLearned(name) : NULL;
+  if (command == NULL || mySwitch.isTransmitting()) {
+    Serial.println("Forget: unknown command or transmitting");
+    return;
+  }
+
+  SPIFFS.remove(String(LEARNED_DIR) + name);
+  *command = learned[--learnedCount];
+  Serial.print("Forgot "); Serial.println(name);
+}
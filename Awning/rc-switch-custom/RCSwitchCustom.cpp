@@ -27,17 +27,72 @@
 
 #include "RCSwitchCustom.h"
 
-unsigned long CRCSwitch::nReceivedValue = NULL;
-unsigned int CRCSwitch::nReceivedBitlength = 0;
-unsigned int CRCSwitch::nReceivedDelay = 0;
-unsigned int CRCSwitch::nReceivedProtocol = 0;
+#if defined(ESP8266)
+  // timer1 runs at 80 MHz / 16
+  #define CRCSwitch_TIMER_TICKS_PER_US 5
+#endif
+
+#ifndef ICACHE_RAM_ATTR
+  #define ICACHE_RAM_ATTR
+#endif
+
 unsigned int CRCSwitch::timings[CRCSwitch_MAX_CHANGES];
+volatile unsigned long CRCSwitch::edgeTimes[CRCSwitch_MAX_EDGES];
+volatile unsigned int CRCSwitch::nEdgeHead = 0;
+volatile unsigned int CRCSwitch::nEdgeTail = 0;
+volatile unsigned long CRCSwitch::nDroppedEdges = 0;
+volatile byte CRCSwitch::edgeGaps[CRCSwitch_MAX_EDGES / 8];
+volatile bool CRCSwitch::bEdgeGap = false;
+unsigned int CRCSwitch::nChangeCount = 0;
+unsigned int CRCSwitch::nRepeatCount = 0;
+unsigned long CRCSwitch::nLastTime = 0;
+CRCSwitchReceived CRCSwitch::receivedCodes[CRCSwitch_RECEIVE_QUEUE_SIZE];
+byte CRCSwitch::nReceivedHead = 0;
+byte CRCSwitch::nReceivedTail = 0;
+unsigned long CRCSwitch::nDroppedCodes = 0;
+bool CRCSwitch::bLearning = false;
+unsigned int CRCSwitch::learnTimings[CRCSwitch_MAX_LEARN_CHANGES];
+unsigned int CRCSwitch::nLearnChanges = 0;
+unsigned int CRCSwitch::nLearnChecked = 0;
 int CRCSwitch::nReceiveTolerance = 60;
 
+/**
+ * Protocol descriptors, adding a protocol is adding a line.
+ * Sync, zero and one are high and low times in pulse lengths.
+ *
+ * Protocol 4 is for awning shutters, its sync bit goes before the code
+ * word in sendQuadState(). Its 40 bit words have no gap to split them at
+ * and do not fit the received value, so it is not decoded. learn() can
+ * still capture it.
+ */
+constexpr CRCSwitchProtocol protocols[] = {
+  { 1, 350, {  1, 31 }, { 1, 3 }, { 3, 1 }, false, 10 },
+  { 2, 650, {  1, 10 }, { 1, 2 }, { 2, 1 }, false, 10 },
+  { 4, 250, { 18,  6 }, { 1, 3 }, { 3, 1 }, false, 4 }
+};
+
+#define CRCSwitch_PROTOCOL_COUNT (sizeof(protocols) / sizeof(protocols[0]))
+
+static_assert(CRCSwitch_PROTOCOL_COUNT <= 16, "the decoder keeps one bit per protocol");
+static_assert((CRCSwitch_MAX_EDGES & (CRCSwitch_MAX_EDGES - 1)) == 0, "edge counters wrap");
+CRCSwitchTxJob CRCSwitch::txQueue[CRCSwitch_TX_QUEUE_SIZE];
+CRCSwitchCode CRCSwitch::txCodes[CRCSwitch_TX_QUEUE_SIZE];
+volatile byte CRCSwitch::nTxTail = 0;
+volatile byte CRCSwitch::nTxHead = 0;
+byte CRCSwitch::nTxReported = 0;
+volatile bool CRCSwitch::bTransmitting = false;
+int CRCSwitch::nTxPin = -1;
+byte CRCSwitch::nTxPulse = 0;
+byte CRCSwitch::nTxRepeat = 0;
+bool CRCSwitch::bTxHigh = false;
+
 CRCSwitch::CRCSwitch() {
   this->nReceiverInterrupt = -1;
   this->nTransmitterPin = -1;
-  CRCSwitch::nReceivedValue = NULL;
+  this->pCompiling = NULL;
+  this->pTransmitCallback = NULL;
+  this->nReceiverInterruptBackup = -1;
+  this->pProtocol = &protocols[0];
   this->setPulseLength(350);
   this->setRepeatTransmit(10);
   this->setReceiveTolerance(60);
@@ -45,20 +100,17 @@ CRCSwitch::CRCSwitch() {
 }
 
 /**
-  * Sets the protocol to send.
+  * Sets the protocol to send with its pulse length and repeat count.
+  * Unknown protocols are ignored.
   */
 void CRCSwitch::setProtocol(int nProtocol) {
-  this->nProtocol = nProtocol;
-  if (nProtocol == 1){
-	  this->setPulseLength(350);
-  }
-  else if (nProtocol == 2) {
-	  this->setPulseLength(650);
-  }
-  //edit: Protokoll 4 für Rolladen mit Pulslänge 250ms und 4 Wiederholungen
-  else if (nProtocol == 4) {
-    this->setPulseLength(250);
-    this->setRepeatTransmit(4);
+  for (unsigned int i = 0; i < CRCSwitch_PROTOCOL_COUNT; i++) {
+    if (protocols[i].nProtocol == nProtocol) {
+      this->pProtocol = &protocols[i];
+      this->setPulseLength(this->pProtocol->nPulseLength);
+      this->setRepeatTransmit(this->pProtocol->nRepeatTransmit);
+      return;
+    }
   }
 }
 
@@ -66,17 +118,8 @@ void CRCSwitch::setProtocol(int nProtocol) {
   * Sets the protocol to send with pulse length in microseconds.
   */
 void CRCSwitch::setProtocol(int nProtocol, int nPulseLength) {
-  this->nProtocol = nProtocol;
-  if (nProtocol == 1){
-	  this->setPulseLength(nPulseLength);
-  }
-  else if (nProtocol == 2) {
-	  this->setPulseLength(nPulseLength);
-  }
-  //edit: Protokoll 4 für Rolladen mit Pulslänge 250ms und 4 Wiederholungen
-  else if (nProtocol == 4) {
-    this->setPulseLength(nPulseLength);
-  }
+  this->setProtocol(nProtocol);
+  this->setPulseLength(nPulseLength);
 }
 
 
@@ -379,10 +422,242 @@ void CRCSwitch::sendQuadState(char* sCodeWord) {
  * Waveform: |   |_| |___
  */
 void CRCSwitch::sendQQ() {
-  this->transmit(3,1);
-  this->transmit(1,3);
+  this->send1();
+  this->send0();
+}
+
+
+/**
+ * Queues a Tri-State Code Word, see sendTriState()
+ *
+ * @param nTag   Passed to the transmit callback when the word has been sent
+ */
+bool CRCSwitch::queueTriState(char* sCodeWord, int nTag) {
+  return this->queueJob(sCodeWord, 'T', nTag);
+}
+
+/**
+ * Queues a Quad-State Code Word, see sendQuadState()
+ */
+bool CRCSwitch::queueQuadState(char* sCodeWord, int nTag) {
+  return this->queueJob(sCodeWord, 'Q', nTag);
+}
+
+/**
+ * Queues a binary Code Word, see send()
+ */
+bool CRCSwitch::queue(char* sCodeWord, int nTag) {
+  return this->queueJob(sCodeWord, 'B', nTag);
+}
+
+bool CRCSwitch::isTransmitting() {
+  return CRCSwitch::nTxHead != CRCSwitch::nTxTail;
+}
+
+void CRCSwitch::setTransmitCallback(CRCSwitchTxCallback callback) {
+  this->pTransmitCallback = callback;
+}
+
+/**
+ * Reports the sent Code Words and enables receiving again when done
+ */
+void CRCSwitch::handleTransmit() {
+  while (CRCSwitch::nTxReported != CRCSwitch::nTxHead) {
+    int nTag = CRCSwitch::txQueue[CRCSwitch::nTxReported % CRCSwitch_TX_QUEUE_SIZE].nTag;
+    CRCSwitch::nTxReported++;
+    if (this->pTransmitCallback != NULL) {
+      this->pTransmitCallback(nTag);
+    }
+  }
+
+  if (!this->isTransmitting() && this->nReceiverInterruptBackup != -1) {
+    this->enableReceive(this->nReceiverInterruptBackup);
+    this->nReceiverInterruptBackup = -1;
+  }
 }
 
+/**
+ * Compiles a Tri-State Code Word for queueCode()
+ */
+bool CRCSwitch::compileTriState(char* sCodeWord, CRCSwitchCode* pCode) {
+  return this->compileWord(sCodeWord, 'T', pCode);
+}
+
+/**
+ * Compiles a Quad-State Code Word for queueCode()
+ */
+bool CRCSwitch::compileQuadState(char* sCodeWord, CRCSwitchCode* pCode) {
+  return this->compileWord(sCodeWord, 'Q', pCode);
+}
+
+/**
+ * Compiles a binary Code Word for queueCode()
+ */
+bool CRCSwitch::compile(char* sCodeWord, CRCSwitchCode* pCode) {
+  return this->compileWord(sCodeWord, 'B', pCode);
+}
+
+/**
+ * Compiles a Code Word to pulses with the current protocol and repeat count.
+ * The send functions do the encoding for one repeat, transmit() collects
+ * the pulses instead of sending them.
+ *
+ * @param cType   'T' Tri-State, 'Q' Quad-State, 'B' binary
+ */
+bool CRCSwitch::compileWord(char* sCodeWord, char cType, CRCSwitchCode* pCode) {
+  int nRepeat = this->nRepeatTransmit;
+  pCode->nPulseLength = this->nPulseLength;
+  pCode->nRepeat = nRepeat > 255 ? 255 : nRepeat;
+  pCode->bInverted = this->pProtocol->bInverted;
+  pCode->nPulses = 0;
+
+  this->nRepeatTransmit = 1;
+  this->pCompiling = pCode;
+  switch (cType) {
+    case 'T':
+      this->sendTriState(sCodeWord);
+    break;
+    case 'Q':
+      this->sendQuadState(sCodeWord);
+    break;
+    default:
+      this->send(sCodeWord);
+    break;
+  }
+  this->pCompiling = NULL;
+  this->nRepeatTransmit = nRepeat;
+
+  bool bValid = pCode->nRepeat > 0 && pCode->nPulses > 0 && pCode->nPulses <= CRCSwitch_MAX_PULSES;
+  if (!bValid) {
+    pCode->nPulses = 0;
+  }
+  return bValid;
+}
+
+bool CRCSwitch::queueJob(char* sCodeWord, char cType, int nTag) {
+  // a slot is free once handleTransmit() has reported it
+  if ((byte)(CRCSwitch::nTxTail - CRCSwitch::nTxReported) >= CRCSwitch_TX_QUEUE_SIZE) {
+    return false;
+  }
+
+  CRCSwitchCode* pCode = &CRCSwitch::txCodes[CRCSwitch::nTxTail % CRCSwitch_TX_QUEUE_SIZE];
+  return this->compileWord(sCodeWord, cType, pCode) && this->queueCode(pCode, nTag);
+}
+
+/**
+ * Queues a compiled Code Word
+ *
+ * @param nTag   Passed to the transmit callback when the word has been sent
+ */
+bool CRCSwitch::queueCode(const CRCSwitchCode* pCode, int nTag) {
+  if (this->nTransmitterPin == -1 || pCode == NULL || pCode->nPulses == 0) {
+    return false;
+  }
+
+  // a slot is free once handleTransmit() has reported it
+  if ((byte)(CRCSwitch::nTxTail - CRCSwitch::nTxReported) >= CRCSwitch_TX_QUEUE_SIZE) {
+    return false;
+  }
+
+  CRCSwitchTxJob* pJob = &CRCSwitch::txQueue[CRCSwitch::nTxTail % CRCSwitch_TX_QUEUE_SIZE];
+  pJob->pCode = pCode;
+  pJob->nTag = nTag;
+
+#if defined(ESP8266)
+  // do not receive our own transmission
+  if (this->nReceiverInterrupt != -1) {
+    this->nReceiverInterruptBackup = this->nReceiverInterrupt;
+    this->disableReceive();
+  }
+
+  CRCSwitch::nTxPin = this->nTransmitterPin;
+  noInterrupts();
+  CRCSwitch::nTxTail++;
+  if (!CRCSwitch::bTransmitting) {
+    CRCSwitch::startJob();
+  }
+  interrupts();
+#else
+  // no timer, send it now with the pulse length and inversion it was
+  // compiled with
+  int nReceiverInterrupt_backup = this->nReceiverInterrupt;
+  if (nReceiverInterrupt_backup != -1) {
+    this->disableReceive();
+  }
+  for (int nRepeat = 0; nRepeat < pCode->nRepeat; nRepeat++) {
+    for (int i = 0; i < pCode->nPulses; i++) {
+      digitalWrite(this->nTransmitterPin, pCode->bInverted ? LOW : HIGH);
+      delayMicroseconds(pCode->nPulseLength * pCode->pulses[2 * i]);
+      digitalWrite(this->nTransmitterPin, pCode->bInverted ? HIGH : LOW);
+      delayMicroseconds(pCode->nPulseLength * pCode->pulses[2 * i + 1]);
+    }
+  }
+  if (nReceiverInterrupt_backup != -1) {
+    this->enableReceive(nReceiverInterrupt_backup);
+  }
+  CRCSwitch::nTxTail++;
+  CRCSwitch::nTxHead++;
+#endif
+
+  return true;
+}
+
+#if defined(ESP8266)
+/**
+ * Starts the job at the head of the queue, interrupts must be disabled
+ */
+void ICACHE_RAM_ATTR CRCSwitch::startJob() {
+  const CRCSwitchCode* pCode = CRCSwitch::txQueue[CRCSwitch::nTxHead % CRCSwitch_TX_QUEUE_SIZE].pCode;
+  CRCSwitch::bTransmitting = true;
+  CRCSwitch::nTxPulse = 0;
+  CRCSwitch::nTxRepeat = 0;
+  CRCSwitch::bTxHigh = true;
+
+  timer1_attachInterrupt(CRCSwitch::handleTransmitInterrupt);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_SINGLE);
+  digitalWrite(CRCSwitch::nTxPin, pCode->bInverted ? LOW : HIGH);
+  timer1_write(pCode->pulses[0] * pCode->nPulseLength * CRCSwitch_TIMER_TICKS_PER_US);
+}
+
+/**
+ * Ends the current pulse and starts the next one
+ */
+void ICACHE_RAM_ATTR CRCSwitch::handleTransmitInterrupt() {
+  const CRCSwitchCode* pCode = CRCSwitch::txQueue[CRCSwitch::nTxHead % CRCSwitch_TX_QUEUE_SIZE].pCode;
+
+  if (CRCSwitch::bTxHigh) {
+    digitalWrite(CRCSwitch::nTxPin, pCode->bInverted ? HIGH : LOW);
+    CRCSwitch::bTxHigh = false;
+    timer1_write(pCode->pulses[2 * CRCSwitch::nTxPulse + 1] * pCode->nPulseLength * CRCSwitch_TIMER_TICKS_PER_US);
+    return;
+  }
+
+  if (++CRCSwitch::nTxPulse >= pCode->nPulses) {
+    CRCSwitch::nTxPulse = 0;
+    if (++CRCSwitch::nTxRepeat >= pCode->nRepeat) {
+      // done, continue with the next job without a gap
+      CRCSwitch::nTxHead++;
+      if (CRCSwitch::nTxHead != CRCSwitch::nTxTail) {
+        CRCSwitch::startJob();
+      } else {
+        CRCSwitch::bTransmitting = false;
+        timer1_disable();
+      }
+      return;
+    }
+  }
+
+  digitalWrite(CRCSwitch::nTxPin, pCode->bInverted ? LOW : HIGH);
+  CRCSwitch::bTxHigh = true;
+  timer1_write(pCode->pulses[2 * CRCSwitch::nTxPulse] * pCode->nPulseLength * CRCSwitch_TIMER_TICKS_PER_US);
+}
+#else
+void CRCSwitch::startJob() {
+}
+
+void CRCSwitch::handleTransmitInterrupt() {
+}
+#endif
 
 void CRCSwitch::send(unsigned long Code, unsigned int length) {
   this->send( this->dec2binWzerofill(Code, length) );
@@ -407,6 +682,20 @@ void CRCSwitch::send(char* sCodeWord) {
 }
 
 void CRCSwitch::transmit(int nHighPulses, int nLowPulses) {
+    if (this->pCompiling != NULL) {
+        // compiling, collect the pulse instead of sending it
+        byte n = this->pCompiling->nPulses;
+        if (n < CRCSwitch_MAX_PULSES) {
+            this->pCompiling->pulses[2 * n] = nHighPulses;
+            this->pCompiling->pulses[2 * n + 1] = nLowPulses;
+        }
+        // one past the limit marks an overflow
+        if (n <= CRCSwitch_MAX_PULSES) {
+            this->pCompiling->nPulses = n + 1;
+        }
+        return;
+    }
+
     boolean disabled_Receive = false;
     int nReceiverInterrupt_backup = nReceiverInterrupt;
     if (this->nTransmitterPin != -1) {
@@ -414,45 +703,35 @@ void CRCSwitch::transmit(int nHighPulses, int nLowPulses) {
             this->disableReceive();
             disabled_Receive = true;
         }
-        digitalWrite(this->nTransmitterPin, HIGH);
+        digitalWrite(this->nTransmitterPin, this->pProtocol->bInverted ? LOW : HIGH);
         delayMicroseconds( this->nPulseLength * nHighPulses);
-        digitalWrite(this->nTransmitterPin, LOW);
+        digitalWrite(this->nTransmitterPin, this->pProtocol->bInverted ? HIGH : LOW);
         delayMicroseconds( this->nPulseLength * nLowPulses);
         if(disabled_Receive){
             this->enableReceive(nReceiverInterrupt_backup);
         }
     }
 }
+void CRCSwitch::transmit(CRCSwitchPulse pulse) {
+  this->transmit(pulse.high, pulse.low);
+}
+
 /**
  * Sends a "0" Bit
  *                       _
  * Waveform Protocol 1: | |___
- *                       _
- * Waveform Protocol 2: | |__
  */
 void CRCSwitch::send0() {
-	if (this->nProtocol == 1){
-		this->transmit(1,3);
-	}
-  else if (this->nProtocol == 2) {
-		this->transmit(1,2);
-	}
+  this->transmit(this->pProtocol->zero);
 }
 
 /**
  * Sends a "1" Bit
  *                       ___
  * Waveform Protocol 1: |   |_
- *                       __
- * Waveform Protocol 2: |  |_
  */
 void CRCSwitch::send1() {
-  	if (this->nProtocol == 1){
-		this->transmit(3,1);
-	}
-	else if (this->nProtocol == 2) {
-		this->transmit(2,1);
-	}
+  this->transmit(this->pProtocol->one);
 }
 
 
@@ -462,8 +741,8 @@ void CRCSwitch::send1() {
  * Waveform: | |___| |___
  */
 void CRCSwitch::sendT0() {
-  this->transmit(1,3);
-  this->transmit(1,3);
+  this->send0();
+  this->send0();
 }
 
 /**
@@ -472,8 +751,8 @@ void CRCSwitch::sendT0() {
  * Waveform: |   |_|   |_
  */
 void CRCSwitch::sendT1() {
-  this->transmit(3,1);
-  this->transmit(3,1);
+  this->send1();
+  this->send1();
 }
 
 /**
@@ -482,29 +761,17 @@ void CRCSwitch::sendT1() {
  * Waveform: | |___|   |_
  */
 void CRCSwitch::sendTF() {
-  this->transmit(1,3);
-  this->transmit(3,1);
+  this->send0();
+  this->send1();
 }
 
 /**
  * Sends a "Sync" Bit
  *                       _
  * Waveform Protocol 1: | |_______________________________
- *                       _
- * Waveform Protocol 2: | |__________
  */
 void CRCSwitch::sendSync() {
-
-    if (this->nProtocol == 1){
-		this->transmit(1,31);
-	}
-	else if (this->nProtocol == 2) {
-		this->transmit(1,10);
-	}
-   //edit: Syn-Bit für Rolladen
-   else if (this->nProtocol == 4) {
-       this->transmit(18,6);
-   }
+  this->transmit(this->pProtocol->sync);
 }
 
 /**
@@ -517,8 +784,8 @@ void CRCSwitch::enableReceive(int interrupt) {
 
 void CRCSwitch::enableReceive() {
   if (this->nReceiverInterrupt != -1) {
-    CRCSwitch::nReceivedValue = NULL;
-    CRCSwitch::nReceivedBitlength = NULL;
+    // edges from before were not seen, start over
+    CRCSwitch::resetEdges();
     attachInterrupt(this->nReceiverInterrupt, handleInterrupt, CHANGE);
   }
 }
@@ -531,140 +798,412 @@ void CRCSwitch::disableReceive() {
   this->nReceiverInterrupt = -1;
 }
 
+/**
+ * Decodes the edges the interrupt has timestamped since the last call
+ */
+void CRCSwitch::handleReceive() {
+  while (CRCSwitch::nEdgeTail != CRCSwitch::nEdgeHead) {
+    unsigned int nTail = CRCSwitch::nEdgeTail;
+    unsigned int nSlot = nTail % CRCSwitch_MAX_EDGES;
+    unsigned long nTime = CRCSwitch::edgeTimes[nSlot];
+    bool bGap = CRCSwitch::edgeGaps[nSlot / 8] & (1 << (nSlot % 8));
+    CRCSwitch::nEdgeTail = nTail + 1;
+
+    // edges were dropped before this one, what came before it cannot be
+    // continued and it starts a new code
+    if (bGap) {
+      CRCSwitch::nChangeCount = 0;
+      CRCSwitch::nRepeatCount = 0;
+      CRCSwitch::nLearnChanges = 0;
+      CRCSwitch::nLearnChecked = 0;
+      CRCSwitch::nLastTime = nTime;
+      continue;
+    }
+
+    CRCSwitch::handleEdge(nTime);
+  }
+}
+
 bool CRCSwitch::available() {
-  return CRCSwitch::nReceivedValue != NULL;
+  this->handleReceive();
+  return CRCSwitch::nReceivedHead != CRCSwitch::nReceivedTail;
 }
 
 void CRCSwitch::resetAvailable() {
-  CRCSwitch::nReceivedValue = NULL;
+  if (CRCSwitch::nReceivedHead != CRCSwitch::nReceivedTail) {
+    CRCSwitch::nReceivedHead++;
+  }
+}
+
+bool CRCSwitch::receive(CRCSwitchReceived* pReceived) {
+  if (!this->available()) {
+    return false;
+  }
+
+  *pReceived = CRCSwitch::receivedCodes[CRCSwitch::nReceivedHead % CRCSwitch_RECEIVE_QUEUE_SIZE];
+  CRCSwitch::nReceivedHead++;
+  return true;
+}
+
+unsigned long CRCSwitch::getDroppedEdges() {
+  return CRCSwitch::nDroppedEdges;
+}
+
+unsigned long CRCSwitch::getDroppedCodes() {
+  return CRCSwitch::nDroppedCodes;
 }
 
 unsigned long CRCSwitch::getReceivedValue() {
-    return CRCSwitch::nReceivedValue;
+  return this->available() ? CRCSwitch::receivedCodes[CRCSwitch::nReceivedHead % CRCSwitch_RECEIVE_QUEUE_SIZE].nValue : 0;
 }
 
 unsigned int CRCSwitch::getReceivedBitlength() {
-  return CRCSwitch::nReceivedBitlength;
+  return this->available() ? CRCSwitch::receivedCodes[CRCSwitch::nReceivedHead % CRCSwitch_RECEIVE_QUEUE_SIZE].nBitlength : 0;
 }
 
 unsigned int CRCSwitch::getReceivedDelay() {
-  return CRCSwitch::nReceivedDelay;
+  return this->available() ? CRCSwitch::receivedCodes[CRCSwitch::nReceivedHead % CRCSwitch_RECEIVE_QUEUE_SIZE].nDelay : 0;
 }
 
 unsigned int CRCSwitch::getReceivedProtocol() {
-  return CRCSwitch::nReceivedProtocol;
+  return this->available() ? CRCSwitch::receivedCodes[CRCSwitch::nReceivedHead % CRCSwitch_RECEIVE_QUEUE_SIZE].nProtocol : 0;
+}
+
+unsigned long CRCSwitch::getReceivedTime() {
+  return this->available() ? CRCSwitch::receivedCodes[CRCSwitch::nReceivedHead % CRCSwitch_RECEIVE_QUEUE_SIZE].nTime : 0;
 }
 
 unsigned int* CRCSwitch::getReceivedRawdata() {
     return CRCSwitch::timings;
 }
 
+static inline bool matchPulse(unsigned long nDuration, unsigned long nExpected, unsigned long nTolerance) {
+  return nDuration > nExpected - nTolerance && nDuration < nExpected + nTolerance;
+}
+
 /**
- *
+ * Decodes timings[] with all protocols in one pass. The pulse length of
+ * each protocol comes from the sync gap in timings[0], so only protocols
+ * whose sync ends with the long low gap are tried.
  */
-bool CRCSwitch::receiveProtocol1(unsigned int changeCount){
+bool CRCSwitch::receiveProtocol(unsigned int changeCount, CRCSwitchReceived* pReceived) {
+  // ignore < 4bit values as there are no devices sending 4bit values => noise
+  if (changeCount <= 6) {
+    return false;
+  }
 
-	  unsigned long code = 0;
-      unsigned long delay = CRCSwitch::timings[0] / 31;
-      unsigned long delayTolerance = delay * CRCSwitch::nReceiveTolerance * 0.01;
+  unsigned long codes[CRCSwitch_PROTOCOL_COUNT];
+  unsigned long delays[CRCSwitch_PROTOCOL_COUNT];
+  unsigned long tolerances[CRCSwitch_PROTOCOL_COUNT];
+  unsigned int nCandidates = 0;
+  for (unsigned int p = 0; p < CRCSwitch_PROTOCOL_COUNT; p++) {
+    codes[p] = 0;
+    delays[p] = CRCSwitch::timings[0] / protocols[p].sync.low;
+    tolerances[p] = delays[p] * CRCSwitch::nReceiveTolerance / 100;
+    if (protocols[p].sync.low > protocols[p].sync.high) {
+      nCandidates |= 1 << p;
+    }
+  }
 
-      for (int i = 1; i<changeCount ; i=i+2) {
+  for (unsigned int i = 1; i < changeCount && nCandidates != 0; i = i + 2) {
+    for (unsigned int p = 0; p < CRCSwitch_PROTOCOL_COUNT; p++) {
+      if (!(nCandidates & (1 << p))) {
+        continue;
+      }
 
-          if (CRCSwitch::timings[i] > delay-delayTolerance && CRCSwitch::timings[i] < delay+delayTolerance && CRCSwitch::timings[i+1] > delay*3-delayTolerance && CRCSwitch::timings[i+1] < delay*3+delayTolerance) {
-            code = code << 1;
-          } else if (CRCSwitch::timings[i] > delay*3-delayTolerance && CRCSwitch::timings[i] < delay*3+delayTolerance && CRCSwitch::timings[i+1] > delay-delayTolerance && CRCSwitch::timings[i+1] < delay+delayTolerance) {
-            code+=1;
-            code = code << 1;
-          } else {
-            // Failed
-            i = changeCount;
-            code = 0;
-          }
+      const CRCSwitchProtocol& protocol = protocols[p];
+      if (matchPulse(CRCSwitch::timings[i], delays[p] * protocol.zero.high, tolerances[p]) &&
+          matchPulse(CRCSwitch::timings[i + 1], delays[p] * protocol.zero.low, tolerances[p])) {
+        codes[p] = codes[p] << 1;
+      } else if (matchPulse(CRCSwitch::timings[i], delays[p] * protocol.one.high, tolerances[p]) &&
+                 matchPulse(CRCSwitch::timings[i + 1], delays[p] * protocol.one.low, tolerances[p])) {
+        codes[p] = (codes[p] << 1) | 1;
+      } else {
+        nCandidates &= ~(1 << p);
       }
-      code = code >> 1;
-    if (changeCount > 6) {    // ignore < 4bit values as there are no devices sending 4bit values => noise
-      CRCSwitch::nReceivedValue = code;
-      CRCSwitch::nReceivedBitlength = changeCount / 2;
-      CRCSwitch::nReceivedDelay = delay;
-	  CRCSwitch::nReceivedProtocol = 1;
     }
+  }
 
-	if (code == 0){
-		return false;
-	}else if (code != 0){
-		return true;
-	}
+  // the first protocol in the table wins
+  for (unsigned int p = 0; p < CRCSwitch_PROTOCOL_COUNT; p++) {
+    if ((nCandidates & (1 << p)) && codes[p] != 0) {
+      pReceived->nValue = codes[p];
+      pReceived->nBitlength = changeCount / 2;
+      pReceived->nDelay = delays[p];
+      pReceived->nProtocol = protocols[p].nProtocol;
+      return true;
+    }
+  }
 
+  return false;
+}
 
+/**
+ * Only timestamps the edge, decoding is left to handleReceive()
+ */
+void ICACHE_RAM_ATTR CRCSwitch::handleInterrupt() {
+  unsigned int nHead = CRCSwitch::nEdgeHead;
+  if (nHead - CRCSwitch::nEdgeTail >= CRCSwitch_MAX_EDGES) {
+    CRCSwitch::nDroppedEdges++;
+    CRCSwitch::bEdgeGap = true;
+    return;
+  }
+
+  // the gap is marked where it is, on the first edge stored after it
+  unsigned int nSlot = nHead % CRCSwitch_MAX_EDGES;
+  byte nBit = 1 << (nSlot % 8);
+  if (CRCSwitch::bEdgeGap) {
+    CRCSwitch::edgeGaps[nSlot / 8] |= nBit;
+    CRCSwitch::bEdgeGap = false;
+  } else {
+    CRCSwitch::edgeGaps[nSlot / 8] &= ~nBit;
+  }
+  CRCSwitch::edgeTimes[nSlot] = micros();
+  CRCSwitch::nEdgeHead = nHead + 1;
 }
 
-bool CRCSwitch::receiveProtocol2(unsigned int changeCount){
+void CRCSwitch::resetEdges() {
+  CRCSwitch::nEdgeTail = CRCSwitch::nEdgeHead;
+  CRCSwitch::nChangeCount = 0;
+  CRCSwitch::nRepeatCount = 0;
+}
 
-	  unsigned long code = 0;
-      unsigned long delay = CRCSwitch::timings[0] / 10;
-      unsigned long delayTolerance = delay * CRCSwitch::nReceiveTolerance * 0.01;
+/**
+ * Splits the edges to codes at the sync gaps and decodes a code when it
+ * has been repeated
+ */
+void CRCSwitch::handleEdge(unsigned long nTime) {
+  unsigned long duration = nTime - CRCSwitch::nLastTime;
 
-      for (int i = 1; i<changeCount ; i=i+2) {
+  if (CRCSwitch::bLearning && CRCSwitch::nLearnChanges < CRCSwitch_MAX_LEARN_CHANGES) {
+    CRCSwitch::learnTimings[CRCSwitch::nLearnChanges++] = duration < (unsigned int)-1 ? duration : (unsigned int)-1;
+  }
 
-          if (CRCSwitch::timings[i] > delay-delayTolerance && CRCSwitch::timings[i] < delay+delayTolerance && CRCSwitch::timings[i+1] > delay*2-delayTolerance && CRCSwitch::timings[i+1] < delay*2+delayTolerance) {
-            code = code << 1;
-          } else if (CRCSwitch::timings[i] > delay*2-delayTolerance && CRCSwitch::timings[i] < delay*2+delayTolerance && CRCSwitch::timings[i+1] > delay-delayTolerance && CRCSwitch::timings[i+1] < delay+delayTolerance) {
-            code+=1;
-            code = code << 1;
-          } else {
-            // Failed
-            i = changeCount;
-            code = 0;
-          }
+  if (duration > 5000 && duration > CRCSwitch::timings[0] - 200 && duration < CRCSwitch::timings[0] + 200) {
+    CRCSwitch::nRepeatCount++;
+    CRCSwitch::nChangeCount--;
+    if (CRCSwitch::nRepeatCount == 2) {
+      CRCSwitchReceived received;
+      if (receiveProtocol(CRCSwitch::nChangeCount, &received)) {
+        received.nTime = nTime;
+        if ((byte)(CRCSwitch::nReceivedTail - CRCSwitch::nReceivedHead) >= CRCSwitch_RECEIVE_QUEUE_SIZE) {
+          CRCSwitch::nDroppedCodes++;
+        } else {
+          CRCSwitch::receivedCodes[CRCSwitch::nReceivedTail % CRCSwitch_RECEIVE_QUEUE_SIZE] = received;
+          CRCSwitch::nReceivedTail++;
+        }
       }
-      code = code >> 1;
-    if (changeCount > 6) {    // ignore < 4bit values as there are no devices sending 4bit values => noise
-      CRCSwitch::nReceivedValue = code;
-      CRCSwitch::nReceivedBitlength = changeCount / 2;
-      CRCSwitch::nReceivedDelay = delay;
-	  CRCSwitch::nReceivedProtocol = 2;
+      CRCSwitch::nRepeatCount = 0;
     }
+    CRCSwitch::nChangeCount = 0;
+  } else if (duration > 5000) {
+    CRCSwitch::nChangeCount = 0;
+  }
 
-	if (code == 0){
-		return false;
-	}else if (code != 0){
-		return true;
-	}
+  if (CRCSwitch::nChangeCount >= CRCSwitch_MAX_CHANGES) {
+    CRCSwitch::nChangeCount = 0;
+    CRCSwitch::nRepeatCount = 0;
+  }
+  CRCSwitch::timings[CRCSwitch::nChangeCount++] = duration;
+  CRCSwitch::nLastTime = nTime;
+}
 
+/**
+ * Starts capturing raw pulses for learn()
+ */
+void CRCSwitch::startLearning() {
+  CRCSwitch::nLearnChanges = 0;
+  CRCSwitch::nLearnChecked = 0;
+  CRCSwitch::bLearning = true;
+}
+
+void CRCSwitch::stopLearning() {
+  CRCSwitch::bLearning = false;
 }
-void CRCSwitch::handleInterrupt() {
 
-  static unsigned int duration;
-  static unsigned int changeCount;
-  static unsigned long lastTime;
-  static unsigned int repeatCount;
+bool CRCSwitch::isLearning() {
+  return CRCSwitch::bLearning;
+}
+
+/**
+ * Looks for a repeated code word in the pulses captured so far
+ *
+ * @param pCode       The learned code, compiled with the current repeat count
+ * @param pProtocol   Optional, what the pulses look like
+ * @return true when learning is done
+ */
+bool CRCSwitch::learn(CRCSwitchCode* pCode, CRCSwitchProtocol* pProtocol) {
+  this->handleReceive();
+  if (!CRCSwitch::bLearning || CRCSwitch::nLearnChanges == CRCSwitch::nLearnChecked) {
+    return false;
+  }
+  CRCSwitch::nLearnChecked = CRCSwitch::nLearnChanges;
 
+  CRCSwitchProtocol protocol;
+  if (this->learnCode(pCode, pProtocol != NULL ? pProtocol : &protocol)) {
+    CRCSwitch::bLearning = false;
+    return true;
+  }
 
-  long time = micros();
-  duration = time - lastTime;
+  // nothing repeated in a full buffer, start over
+  if (CRCSwitch::nLearnChanges >= CRCSwitch_MAX_LEARN_CHANGES) {
+    CRCSwitch::nLearnChanges = 0;
+    CRCSwitch::nLearnChecked = 0;
+  }
+  return false;
+}
 
-  if (duration > 5000 && duration > CRCSwitch::timings[0] - 200 && duration < CRCSwitch::timings[0] + 200) {
-    repeatCount++;
-    changeCount--;
-    if (repeatCount == 2) {
-		if (receiveProtocol1(changeCount) == false){
-			if (receiveProtocol2(changeCount) == false){
-				//failed
-			}
-		}
-      repeatCount = 0;
+static inline bool isLearnedBit(const byte* widths, unsigned int i, unsigned int nBitLength) {
+  return widths[i] != 0 && widths[i + 1] != 0 && widths[i] + widths[i + 1] == nBitLength;
+}
+
+static inline bool isLearnedSync(const byte* widths, unsigned int i, unsigned int nBitLength) {
+  return widths[i] != 0 && widths[i + 1] != 0 && widths[i] + widths[i + 1] > nBitLength;
+}
+
+/**
+ * Clusters learnTimings[] to pulse lengths. The shortest pulses give the
+ * pulse length. Data bits all have the same length, so the widths are
+ * paired to high and low pulses the way that makes most pairs equally
+ * long. The longer pairs between the bits are sync bits.
+ */
+bool CRCSwitch::learnCode(CRCSwitchCode* pCode, CRCSwitchProtocol* pProtocol) {
+  const unsigned int* timings = CRCSwitch::learnTimings;
+  unsigned int nChanges = CRCSwitch::nLearnChanges;
+
+  unsigned long nShortest = (unsigned long)-1;
+  for (unsigned int i = 0; i < nChanges; i++) {
+    if (timings[i] >= CRCSwitch_MIN_LEARN_PULSE && timings[i] < nShortest) {
+      nShortest = timings[i];
     }
-    changeCount = 0;
-  } else if (duration > 5000) {
-    changeCount = 0;
   }
+  if (nShortest == (unsigned long)-1) {
+    return false;
+  }
+
+  unsigned long nSum = 0;
+  unsigned int nCount = 0;
+  for (unsigned int i = 0; i < nChanges; i++) {
+    if (timings[i] >= nShortest && 2 * timings[i] < 3 * nShortest) {
+      nSum += timings[i];
+      nCount++;
+    }
+  }
+  unsigned long nPulseLength = nSum / nCount;
 
-  if (changeCount >= CRCSwitch_MAX_CHANGES) {
-    changeCount = 0;
-    repeatCount = 0;
+  // widths in pulse lengths, 0 for noise and gaps
+  byte widths[CRCSwitch_MAX_LEARN_CHANGES];
+  for (unsigned int i = 0; i < nChanges; i++) {
+    unsigned long nWidth = (timings[i] + nPulseLength / 2) / nPulseLength;
+    widths[i] = timings[i] >= CRCSwitch_MIN_LEARN_PULSE && nWidth <= 255 ? nWidth : 0;
   }
-  CRCSwitch::timings[changeCount++] = duration;
-  lastTime = time;
+
+  unsigned int nPhase = 0;
+  unsigned int nBitLength = 0;
+  unsigned int nBest = 0;
+  for (unsigned int nTry = 0; nTry < 2; nTry++) {
+    unsigned int counts[16] = { 0 };
+    for (unsigned int i = nTry; i + 1 < nChanges; i = i + 2) {
+      if (widths[i] != 0 && widths[i + 1] != 0 && widths[i] + widths[i + 1] < 16) {
+        counts[widths[i] + widths[i + 1]]++;
+      }
+    }
+    for (unsigned int n = 2; n < 16; n++) {
+      if (counts[n] > nBest) {
+        nBest = counts[n];
+        nPhase = nTry;
+        nBitLength = n;
+      }
+    }
+  }
+  if (nBest == 0) {
+    return false;
+  }
+
+  // a code word starts at a sync and ends where the same word starts again
+  unsigned int nSync = nPhase;
+  unsigned int nLength = 0;
+  while (nLength == 0) {
+    while (nSync + 1 < nChanges && !isLearnedSync(widths, nSync, nBitLength)) {
+      nSync = nSync + 2;
+    }
+    unsigned int nEnd = nSync + 2;
+    while (nEnd + 1 < nChanges && isLearnedBit(widths, nEnd, nBitLength)) {
+      nEnd = nEnd + 2;
+    }
+    if (nEnd + 1 >= nChanges) {
+      return false;
+    }
+
+    // ignore < 4bit values as in receiveProtocol()
+    unsigned int nPulses = (nEnd - nSync) / 2;
+    if (!isLearnedSync(widths, nEnd, nBitLength) || nPulses <= 4 || nPulses > CRCSwitch_MAX_PULSES) {
+      nSync = nEnd;
+      continue;
+    }
+    if (nEnd + 2 * nPulses > nChanges) {
+      return false;
+    }
+
+    // the long sync pulses may round differently
+    bool bSame = true;
+    for (unsigned int i = 0; i < 2 * nPulses && bSame; i++) {
+      unsigned int a = widths[nSync + i];
+      unsigned int b = widths[nEnd + i];
+      bSame = i < 2 ? a + a / 8 + 1 >= b && b + b / 8 + 1 >= a : a == b;
+    }
+    if (bSame) {
+      nLength = 2 * nPulses;
+    } else {
+      nSync = nEnd;
+    }
+  }
+
+  // a long high sync is sent before the bits, a long low gap after them
+  CRCSwitchPulse sync = { widths[nSync], widths[nSync + 1] };
+  pCode->nPulseLength = nPulseLength;
+  pCode->nRepeat = this->nRepeatTransmit > 255 ? 255 : this->nRepeatTransmit;
+  pCode->bInverted = false;
+  pCode->nPulses = nLength / 2;
+  if (sync.high > sync.low) {
+    memcpy(pCode->pulses, &widths[nSync], nLength);
+  } else {
+    memcpy(pCode->pulses, &widths[nSync + 2], nLength - 2);
+    pCode->pulses[nLength - 2] = sync.high;
+    pCode->pulses[nLength - 1] = sync.low;
+  }
+
+  pProtocol->nProtocol = 0;
+  pProtocol->nPulseLength = nPulseLength;
+  pProtocol->sync = sync;
+  pProtocol->zero.high = widths[nSync + 2];
+  pProtocol->zero.low = widths[nSync + 3];
+  pProtocol->one = pProtocol->zero;
+  for (unsigned int i = nSync + 2; i < nSync + nLength; i = i + 2) {
+    if (widths[i] < pProtocol->zero.high) {
+      pProtocol->zero.high = widths[i];
+      pProtocol->zero.low = widths[i + 1];
+    }
+    if (widths[i] > pProtocol->one.high) {
+      pProtocol->one.high = widths[i];
+      pProtocol->one.low = widths[i + 1];
+    }
+  }
+  pProtocol->bInverted = false;
+  pProtocol->nRepeatTransmit = pCode->nRepeat;
+
+  for (unsigned int p = 0; p < CRCSwitch_PROTOCOL_COUNT; p++) {
+    const CRCSwitchProtocol& protocol = protocols[p];
+    if (protocol.sync.high == sync.high && protocol.sync.low == sync.low &&
+        protocol.zero.high == pProtocol->zero.high && protocol.zero.low == pProtocol->zero.low &&
+        protocol.one.high == pProtocol->one.high && protocol.one.low == pProtocol->one.low &&
+        matchPulse(nPulseLength, protocol.nPulseLength, protocol.nPulseLength * CRCSwitch::nReceiveTolerance / 100)) {
+      pProtocol->nProtocol = protocol.nProtocol;
+      break;
+    }
+  }
+
+  return true;
 }
 
 /**
@@ -36,6 +36,72 @@
 // We can handle up to (unsigned long) => 32 bit * 2 H/L changes per bit + 2 for sync
 #define CRCSwitch_MAX_CHANGES 67
 
+// Edge timestamps buffered between the interrupt and handleReceive(),
+// a power of two
+#define CRCSwitch_MAX_EDGES 256
+
+// Decoded codes waiting to be read
+#define CRCSwitch_RECEIVE_QUEUE_SIZE 8
+
+// A decoded code
+struct CRCSwitchReceived {
+  unsigned long nValue;
+  unsigned int nBitlength;
+  unsigned int nDelay;
+  unsigned int nProtocol;
+  unsigned long nTime;  // micros() of the edge that completed the code
+};
+
+// Raw pulse widths kept while learning, room for the code word three
+// times over
+#define CRCSwitch_MAX_LEARN_CHANGES (6 * CRCSwitch_MAX_PULSES)
+
+// Shorter pulses are noise when learning, microseconds
+#define CRCSwitch_MIN_LEARN_PULSE 100
+
+// High/Low pulse pairs in one repetition of a compiled code word.
+// A quad state word of 32 symbols and the sync bit fit in.
+#define CRCSwitch_MAX_PULSES 66
+
+// Compiled code words waiting to be transmitted, a power of two
+#define CRCSwitch_TX_QUEUE_SIZE 4
+
+// Called from handleTransmit() when a queued code word has been sent
+typedef void (*CRCSwitchTxCallback)(int nTag);
+
+// High and low time of a pulse in pulse lengths
+struct CRCSwitchPulse {
+  byte high;
+  byte low;
+};
+
+// Everything that differs between protocols, see the table in
+// RCSwitchCustom.cpp. Tri-State and Quad-State symbols are made of the
+// zero and one pulses.
+struct CRCSwitchProtocol {
+  byte nProtocol;
+  unsigned int nPulseLength;  // microseconds
+  CRCSwitchPulse sync;
+  CRCSwitchPulse zero;
+  CRCSwitchPulse one;
+  bool bInverted;             // idle high, pulses low
+  byte nRepeatTransmit;
+};
+
+// A code word compiled to pulses with the protocol, pulse length and
+// repeat count it was compiled with. Nothing is parsed while it is sent.
+struct CRCSwitchCode {
+  unsigned int nPulseLength;
+  byte nRepeat;
+  bool bInverted;
+  byte nPulses;
+  byte pulses[CRCSwitch_MAX_PULSES * 2];  // high, low in pulse lengths
+};
+
+struct CRCSwitchTxJob {
+  const CRCSwitchCode* pCode;
+  int nTag;
+};
 
 class CRCSwitch {
 
@@ -57,18 +123,57 @@ class CRCSwitch {
     void send(char* Code);
     void sendQQ();
 
+    // Non-blocking versions of the send functions. On ESP8266 the code word
+    // is compiled and played from the timer1 interrupt, elsewhere it is sent
+    // before returning. Returns false if the queue is full or the code word
+    // is too long.
+    bool queueTriState(char* sCodeWord, int nTag = 0);
+    bool queueQuadState(char* sCodeWord, int nTag = 0);
+    bool queue(char* sCodeWord, int nTag = 0);
+    // Compile a command once and queue it as often as needed, the code
+    // must stay unchanged until it has been sent
+    bool compileTriState(char* sCodeWord, CRCSwitchCode* pCode);
+    bool compileQuadState(char* sCodeWord, CRCSwitchCode* pCode);
+    bool compile(char* sCodeWord, CRCSwitchCode* pCode);
+    bool queueCode(const CRCSwitchCode* pCode, int nTag = 0);
+    bool isTransmitting();
+    void setTransmitCallback(CRCSwitchTxCallback callback);
+    // Call from loop(), reports sent code words to the callback
+    void handleTransmit();
+
     void enableReceive(int interrupt);
     void enableReceive();
     void disableReceive();
+    // The interrupt only timestamps edges, they are decoded here.
+    // available() calls it too. Protocols with a leading sync, like
+    // protocol 4, are not decoded, use learning for them.
+    void handleReceive();
     bool available();
+    // Drops the oldest code
 	void resetAvailable();
+    // Pops the oldest code, returns false if there is none
+    bool receive(CRCSwitchReceived* pReceived);
+    unsigned long getDroppedEdges();
+    unsigned long getDroppedCodes();
 
+    // The oldest code
     unsigned long getReceivedValue();
     unsigned int getReceivedBitlength();
     unsigned int getReceivedDelay();
 	unsigned int getReceivedProtocol();
+    unsigned long getReceivedTime();
     unsigned int* getReceivedRawdata();
 
+    // Learning captures raw pulses until a code word has been seen twice
+    // in a row, then clusters the pulse widths to a compiled code that
+    // can be queued. The protocol is filled with what the pulses look
+    // like, nProtocol is 0 if it is none of the known ones.
+    // Call learn() from loop() until it returns true.
+    void startLearning();
+    void stopLearning();
+    bool isLearning();
+    bool learn(CRCSwitchCode* pCode, CRCSwitchProtocol* pProtocol = NULL);
+
     void enableTransmit(int nTransmitterPin);
     void disableTransmit();
     void setPulseLength(int nPulseLength);
@@ -89,25 +194,69 @@ class CRCSwitch {
     void send1();
     void sendSync();
     void transmit(int nHighPulses, int nLowPulses);
+    void transmit(CRCSwitchPulse pulse);
+    bool compileWord(char* sCodeWord, char cType, CRCSwitchCode* pCode);
+    bool queueJob(char* sCodeWord, char cType, int nTag);
+    static void startJob();
+    static void handleTransmitInterrupt();
 
     static char* dec2binWzerofill(unsigned long dec, unsigned int length);
 
     static void handleInterrupt();
-	static bool receiveProtocol1(unsigned int changeCount);
-	static bool receiveProtocol2(unsigned int changeCount);
+    static void handleEdge(unsigned long nTime);
+    static void resetEdges();
+    static bool receiveProtocol(unsigned int changeCount, CRCSwitchReceived* pReceived);
+    bool learnCode(CRCSwitchCode* pCode, CRCSwitchProtocol* pProtocol);
     int nReceiverInterrupt;
     int nTransmitterPin;
     int nPulseLength;
     int nRepeatTransmit;
-	char nProtocol;
+    const CRCSwitchProtocol* pProtocol;
+    CRCSwitchCode* pCompiling;
+    CRCSwitchTxCallback pTransmitCallback;
+    int nReceiverInterruptBackup;
 
 	static int nReceiveTolerance;
-    static unsigned long nReceivedValue;
-    static unsigned int nReceivedBitlength;
-	static unsigned int nReceivedDelay;
-	static unsigned int nReceivedProtocol;
     static unsigned int timings[CRCSwitch_MAX_CHANGES];
 
+    // Written by the interrupt, read by handleReceive(). The counters wrap.
+    static volatile unsigned long edgeTimes[CRCSwitch_MAX_EDGES];
+    static volatile unsigned int nEdgeHead;
+    static volatile unsigned int nEdgeTail;
+    static volatile unsigned long nDroppedEdges;
+    // bit set for an edge stored after edges were dropped
+    static volatile byte edgeGaps[CRCSwitch_MAX_EDGES / 8];
+    static volatile bool bEdgeGap;
+
+    // Splitting the edges to codes
+    static unsigned int nChangeCount;
+    static unsigned int nRepeatCount;
+    static unsigned long nLastTime;
+
+    static CRCSwitchReceived receivedCodes[CRCSwitch_RECEIVE_QUEUE_SIZE];
+    static byte nReceivedHead;
+    static byte nReceivedTail;
+    static unsigned long nDroppedCodes;
+
+    static bool bLearning;
+    static unsigned int learnTimings[CRCSwitch_MAX_LEARN_CHANGES];
+    static unsigned int nLearnChanges;
+    static unsigned int nLearnChecked;
+
+    // The queue is written here, played by the interrupt and freed when
+    // handleTransmit() has reported the job. The counters wrap.
+    static CRCSwitchTxJob txQueue[CRCSwitch_TX_QUEUE_SIZE];
+    // code words queued as strings are compiled here
+    static CRCSwitchCode txCodes[CRCSwitch_TX_QUEUE_SIZE];
+    static volatile byte nTxTail;
+    static volatile byte nTxHead;
+    static byte nTxReported;
+    static volatile bool bTransmitting;
+    static int nTxPin;
+    static byte nTxPulse;
+    static byte nTxRepeat;
+    static bool bTxHigh;
+
 
 };
 
@@ -0,0 +1,90 @@
+// =======================================
+// MINIMAL ARDUINO API FOR HOST BUILDS
+// =======================================
+// only what the IHC library needs, flash is plain memory
+// and time is a simulated clock advanced by the host program
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define memcpy_P memcpy
+
+// simulated time
+unsigned long millis();
+void delay(unsigned long ms);
+void yield();
+void hostAdvanceMillis(unsigned long ms);
+
+// just enough of String for names and prettyPrint()
+class String {
+  public:
+    String(const char* s = "");
+    String(const String& other);
+    ~String();
+    String& operator=(const String& other);
+    const char* c_str() const { return buffer; }
+    unsigned int length() const { return strlen(buffer); }
+    bool operator==(const String& other) const { return strcmp(buffer, other.buffer) == 0; }
+    bool operator==(const char* other) const { return strcmp(buffer, other) == 0; }
+
+  private:
+    char* buffer;
+};
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+
+    size_t print(const char* s);
+    size_t print(const String& s) { return print(s.c_str()); }
+    size_t print(char c);
+    size_t print(unsigned char n, int base = DEC);
+    size_t print(int n, int base = DEC);
+    size_t print(unsigned int n, int base = DEC);
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t println(const char* s);
+    size_t println(const String& s) { return println(s.c_str()); }
+    size_t println(char c);
+    size_t println(unsigned char n, int base = DEC);
+    size_t println(int n, int base = DEC);
+    size_t println(unsigned int n, int base = DEC);
+    size_t println(long n, int base = DEC);
+    size_t println(unsigned long n, int base = DEC);
+    size_t println();
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// debug output goes to stdout
+class HostSerial : public Stream {
+  public:
+    void begin(unsigned long speed) {}
+    size_t write(uint8_t b);
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,187 @@
+// =======================================
+// MINIMAL ARDUINO API FOR HOST BUILDS
+// =======================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "Arduino.h"
+#include "SoftwareSerial.h"
+
+HostSerial Serial;
+
+static unsigned long hostMillis = 0;
+
+unsigned long millis() {
+  return hostMillis;
+}
+
+void delay(unsigned long ms) {
+  hostMillis += ms;
+}
+
+// busy waits must see time pass
+void yield() {
+  hostMillis++;
+}
+
+void hostAdvanceMillis(unsigned long ms) {
+  hostMillis += ms;
+}
+
+// string
+
+String::String(const char* s) {
+  buffer = strdup(s);
+}
+
+String::String(const String& other) {
+  buffer = strdup(other.buffer);
+}
+
+String::~String() {
+  free(buffer);
+}
+
+String& String::operator=(const String& other) {
+  if (this != &other) {
+    free(buffer);
+    buffer = strdup(other.buffer);
+  }
+  return *this;
+}
+
+// print
+
+static size_t printNumber(Print* out, unsigned long n, int base, boolean negative) {
+  char buf[8 * sizeof(long) + 2];
+  char* p = &buf[sizeof(buf) - 1];
+  *p = '\0';
+  do {
+    int digit = n % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n > 0);
+  if (negative) {
+    *--p = '-';
+  }
+
+  return out->print(p);
+}
+
+size_t Print::print(const char* s) {
+  size_t n = 0;
+  while (*s) {
+    n += write(*s++);
+  }
+  return n;
+}
+
+size_t Print::print(char c) {
+  return write(c);
+}
+
+size_t Print::print(unsigned char n, int base) {
+  return printNumber(this, n, base, false);
+}
+
+size_t Print::print(int n, int base) {
+  return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+  return printNumber(this, n, base, false);
+}
+
+size_t Print::print(long n, int base) {
+  if (base == DEC && n < 0) {
+    return printNumber(this, -n, base, true);
+  }
+  return printNumber(this, n, base, false);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return printNumber(this, n, base, false);
+}
+
+size_t Print::println(const char* s) { return print(s) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char n, int base) { return print(n, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println() { return write('\n'); }
+
+size_t HostSerial::write(uint8_t b) {
+  putchar(b);
+  return 1;
+}
+
+// simulated bus
+
+byte SoftwareSerial::bus[HOST_BUS_SIZE];
+size_t SoftwareSerial::head = 0;
+size_t SoftwareSerial::count = 0;
+unsigned long SoftwareSerial::written = 0;
+byte SoftwareSerial::sent[HOST_BUS_SIZE];
+size_t SoftwareSerial::sentCount = 0;
+
+int SoftwareSerial::available() {
+  return count;
+}
+
+int SoftwareSerial::read() {
+  if (count == 0) {
+    return -1;
+  }
+
+  byte b = bus[head];
+  head = (head + 1) % HOST_BUS_SIZE;
+  count--;
+  return b;
+}
+
+int SoftwareSerial::peek() {
+  return count > 0 ? bus[head] : -1;
+}
+
+// our own messages are not echoed back
+size_t SoftwareSerial::write(uint8_t b) {
+  written++;
+  if (sentCount < HOST_BUS_SIZE) {
+    sent[sentCount++] = b;
+  }
+  return 1;
+}
+
+size_t SoftwareSerial::takeWritten(byte* data, size_t length) {
+  size_t n = sentCount < length ? sentCount : length;
+  memcpy(data, sent, n);
+  memmove(sent, sent + n, sentCount - n);
+  sentCount -= n;
+  return n;
+}
+
+boolean SoftwareSerial::inject(const byte* data, size_t length) {
+  boolean ret = true;
+  for (size_t i = 0; i < length; i++) {
+    if (count == HOST_BUS_SIZE) {
+      ret = false;
+      break;
+    }
+    bus[(head + count) % HOST_BUS_SIZE] = data[i];
+    count++;
+  }
+  return ret;
+}
+
+unsigned long SoftwareSerial::getWritten() {
+  return written;
+}
+
+void SoftwareSerial::reset() {
+  head = 0;
+  count = 0;
+  written = 0;
+  sentCount = 0;
+}
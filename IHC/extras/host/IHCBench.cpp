@@ -0,0 +1,371 @@
+// =======================================
+// IHC BUS SIMULATOR AND LATENCY BENCHMARK
+// =======================================
+// Runs IHC on the host against a simulated LK IHC controller. The
+// controller hands out DATA_READY tokens, applies SET_OUTPUT and answers
+// GET_OUTPUTS and GET_INPUTS, while commands are sent at random times.
+// Reports command-to-confirmation latency, missed tokens and CPU time
+// spent in IHC::loop() per received packet.
+//
+// build in this directory:
+// g++ -O2 -std=c++11 -I. -I../../src ../../src/IHC.cpp HostArduino.cpp IHCBench.cpp -o ihc_bench
+//
+// usage: ihc_bench [-d seconds] [-i token ms] [-c commands/min] [-b outputs per command]
+//                  [-n noise%] [-e crc error%] [-m modules] [-s seed] [-r]
+//
+// A missed token is a valid DATA_READY that IHC did not answer although
+// it had commands queued. Noise is random bytes before a packet, a CRC
+// error flips the CRC of a packet, both apply to every controller packet.
+// With -r the controller holds its replies until the next token, so a
+// reply and a token are handled in the same IHC::loop(). Replies are read
+// with IHC::receive() like the sketches do, a lost reply is one that was
+// delivered intact but never returned.
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "IHC.h"
+
+#define REPLY_DELAY 5 // ms from a request to the reply of the controller
+#define DRAIN_TIME (2 * POLLING_INTERVAL) // ms without commands at the end
+
+struct Reply {
+  unsigned long at;
+  byte type;
+};
+
+struct Command {
+  unsigned long sent;
+  byte module;
+  byte port;
+  bool state;
+};
+
+// simulated controller state and counters
+byte outputs[IHC_MAX_MODULES];
+byte inputs[IHC_MAX_MODULES];
+int modules = 8;
+int noise = 0;
+int crcErrors = 0;
+unsigned long framesSent = 0;
+unsigned long framesCorrupted = 0;
+unsigned long noiseBytes = 0;
+
+// STX ID TYPE DATA... ETB CRC, the CRC is the sum of the other bytes
+std::vector<byte> frame(byte id, byte type, const byte* data, int size) {
+  std::vector<byte> bytes;
+  bytes.push_back(IHCDefs::STX);
+  bytes.push_back(id);
+  bytes.push_back(type);
+  bytes.insert(bytes.end(), data, data + size);
+  bytes.push_back(IHCDefs::ETB);
+  byte crc = 0;
+  for (size_t i = 0; i < bytes.size(); i++) {
+    crc += bytes[i];
+  }
+  bytes.push_back(crc);
+  return bytes;
+}
+
+// returns false if the packet was corrupted on the way
+boolean deliver(std::vector<byte> bytes) {
+  boolean valid = true;
+  if (crcErrors > 0 && rand() % 100 < crcErrors) {
+    bytes.back() ^= 1 << (rand() % 8);
+    framesCorrupted++;
+    valid = false;
+  }
+
+  if (noise > 0 && rand() % 100 < noise) {
+    int n = 1 + rand() % 8;
+    for (int i = 0; i < n; i++) {
+      bytes.insert(bytes.begin(), (byte)rand());
+    }
+    noiseBytes += n;
+  }
+
+  SoftwareSerial::inject(&bytes[0], bytes.size());
+  if (valid) {
+    framesSent++;
+  }
+  return valid;
+}
+
+// splits what IHC wrote into packets, a data byte may equal ETB so
+// the CRC decides where a packet ends
+std::vector<std::vector<byte> > splitFrames(const byte* bytes, size_t size) {
+  std::vector<std::vector<byte> > frames;
+  size_t start = 0;
+  while (start < size) {
+    if (bytes[start] != IHCDefs::STX) {
+      start++;
+      continue;
+    }
+
+    byte crc = 0;
+    size_t end = start;
+    for (size_t i = start; i + 1 < size; i++) {
+      crc += bytes[i];
+      if (i >= start + 3 && bytes[i] == IHCDefs::ETB && bytes[i + 1] == crc) {
+        end = i + 2;
+        break;
+      }
+    }
+
+    if (end == start) {
+      fprintf(stderr, "unterminated packet from IHC\n");
+      break;
+    }
+
+    frames.push_back(std::vector<byte>(bytes + start, bytes + end));
+    start = end;
+  }
+  return frames;
+}
+
+// SET_OUTPUT data is output number and state pairs
+void applyOutputs(const std::vector<byte>& packet) {
+  for (size_t i = 3; i + 3 < packet.size(); i += 2) {
+    int module = packet[i] / 10;
+    int port = packet[i] % 10 - 1;
+    if (module < modules && port >= 0 && port < IHC_MAX_PORTS) {
+      if (packet[i + 1]) {
+        outputs[module] |= 1 << port;
+      } else {
+        outputs[module] &= ~(1 << port);
+      }
+    }
+  }
+}
+
+bool isPending(const std::vector<Command>& pending, byte module, byte port) {
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (pending[i].module == module && pending[i].port == port) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char* argv[]) {
+  boolean together = false;
+  unsigned long duration = 600;
+  unsigned long tokenInterval = 100;
+  int commandRate = 10;
+  int batch = 1;
+  unsigned int seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:i:c:b:n:e:m:s:r")) != -1) {
+    switch (opt) {
+      case 'd': duration = atol(optarg); break;
+      case 'i': tokenInterval = atol(optarg); break;
+      case 'c': commandRate = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      case 'n': noise = atoi(optarg); break;
+      case 'e': crcErrors = atoi(optarg); break;
+      case 'm': modules = atoi(optarg); break;
+      case 's': seed = atoi(optarg); break;
+      case 'r': together = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-d seconds] [-i token ms] [-c commands/min] [-b outputs per command]\n"
+                        "       %*s [-n noise%%] [-e crc error%%] [-m modules] [-s seed] [-r]\n",
+                argv[0], (int)strlen(argv[0]), "");
+        return 2;
+    }
+  }
+  srand(seed);
+
+  if (modules < 1 || modules > IHC_MAX_MODULES || batch < 1 || batch > modules * IHC_MAX_PORTS ||
+      tokenInterval < 1) {
+    fprintf(stderr, "invalid arguments\n");
+    return 2;
+  }
+
+  for (int i = 0; i < modules; i++) {
+    outputs[i] = rand();
+    inputs[i] = rand();
+  }
+
+  SoftwareSerial bus(0, 0);
+  IHC ihc;
+  ihc.init(&bus, false);
+
+  std::vector<Reply> replies;
+  std::vector<Command> pending;
+  std::vector<unsigned long> latencies;
+  unsigned long commands = 0;
+  unsigned long rejected = 0;
+  unsigned long tokens = 0;
+  unsigned long tokensAnswered = 0;
+  unsigned long missed = 0;
+  unsigned long polls = 0;
+  unsigned long setPackets = 0;
+  unsigned long repliesSent = 0;
+  unsigned long repliesReceived = 0;
+  boolean tokenValid = false;
+  boolean tokenAnswered = false;
+  boolean hadWork = false;
+  unsigned long nextToken = tokenInterval;
+  double totalNs = 0;
+  double maxNs = 0;
+
+  unsigned long end = duration * 1000;
+  for (unsigned long now = 0; now < end + DRAIN_TIME; now++) {
+    hostAdvanceMillis(1);
+
+    // replies of the controller
+    for (size_t i = 0; i < replies.size();) {
+      if (replies[i].at > now || (together && now < nextToken)) {
+        i++;
+        continue;
+      }
+      byte* states = replies[i].type == IHCDefs::OUTP_STATE ? outputs : inputs;
+      if (deliver(frame(IHCDefs::ID_PC, replies[i].type, states, modules))) {
+        repliesSent++;
+      }
+      replies.erase(replies.begin() + i);
+    }
+
+    // the controller hands the bus to us
+    if (now >= nextToken) {
+      if (tokenValid && hadWork && !tokenAnswered) {
+        missed++;
+      }
+      hadWork = ihc.getQueueDepth() > 0;
+      tokenValid = deliver(frame(IHCDefs::ID_PC, IHCDefs::DATA_READY, NULL, 0));
+      tokenAnswered = false;
+      tokens++;
+      long jitter = tokenInterval / 10;
+      nextToken = now + tokenInterval + (jitter > 0 ? rand() % (2 * jitter + 1) - jitter : 0);
+    }
+
+    // commands flip outputs that are not already waiting for confirmation
+    if (now < end && rand() % 60000 < commandRate) {
+      std::vector<IHCOutputState> scene;
+      for (int tries = 0; (int)scene.size() < batch && tries < 10 * batch; tries++) {
+        IHCOutputState output;
+        output.module = 1 + rand() % modules;
+        output.port = 1 + rand() % IHC_MAX_PORTS;
+        output.state = !(outputs[output.module - 1] & (1 << (output.port - 1)));
+        boolean duplicate = isPending(pending, output.module, output.port);
+        for (size_t i = 0; i < scene.size() && !duplicate; i++) {
+          duplicate = scene[i].module == output.module && scene[i].port == output.port;
+        }
+        if (!duplicate) {
+          scene.push_back(output);
+        }
+      }
+
+      boolean queued;
+      if (scene.size() == 1) {
+        byte data[2] = { (byte)((scene[0].module - 1) * 10 + scene[0].port), scene[0].state };
+        IHCRS485Packet packet;
+        packet.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, data, 2);
+        queued = ihc.send(&packet);
+      } else {
+        queued = !scene.empty() && ihc.sendScene(&scene[0], scene.size());
+      }
+
+      if (queued) {
+        for (size_t i = 0; i < scene.size(); i++) {
+          Command command = { now, scene[i].module, scene[i].port, scene[i].state };
+          pending.push_back(command);
+        }
+        commands++;
+      } else {
+        rejected++;
+      }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    ihc.loop();
+    auto stop = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+    totalNs += ns;
+    if (ns > maxNs) {
+      maxNs = ns;
+    }
+
+    IHCRS485Packet* pReply = ihc.receive();
+    if (pReply != NULL) {
+      repliesReceived++;
+    }
+
+    // what IHC wrote while it had the token
+    byte written[HOST_BUS_SIZE];
+    size_t size = SoftwareSerial::takeWritten(written, sizeof(written));
+    std::vector<std::vector<byte> > frames = splitFrames(written, size);
+    for (size_t i = 0; i < frames.size(); i++) {
+      const std::vector<byte>& packet = frames[i];
+      if (!tokenValid || tokenAnswered) {
+        fprintf(stderr, "%lu: IHC wrote without the token\n", now);
+      }
+      tokenAnswered = true;
+      tokensAnswered++;
+
+      switch (packet[2]) {
+        case IHCDefs::SET_OUTPUT:
+          applyOutputs(packet);
+          setPackets++;
+          break;
+        case IHCDefs::GET_OUTPUTS: {
+          Reply reply = { now + REPLY_DELAY, IHCDefs::OUTP_STATE };
+          replies.push_back(reply);
+          polls++;
+          break;
+        }
+        case IHCDefs::GET_INPUTS: {
+          Reply reply = { now + REPLY_DELAY, IHCDefs::INP_STATE };
+          replies.push_back(reply);
+          polls++;
+          break;
+        }
+      }
+    }
+
+    // confirmed once IHC has seen the state in an OUTP_STATE
+    for (size_t i = 0; i < pending.size();) {
+      if (ihc.getOutput(pending[i].module, pending[i].port) == pending[i].state) {
+        latencies.push_back(now - pending[i].sent);
+        pending.erase(pending.begin() + i);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  double mean = 0;
+  for (size_t i = 0; i < latencies.size(); i++) {
+    mean += latencies[i];
+  }
+  if (!latencies.empty()) {
+    mean /= latencies.size();
+  }
+
+  printf("simulated time      %lu s + %lu s drain\n", duration, (unsigned long)DRAIN_TIME / 1000);
+  printf("tokens              %lu, answered %lu, missed %lu\n", tokens, tokensAnswered, missed);
+  printf("commands            %lu, rejected %lu, SET_OUTPUT packets %lu\n", commands, rejected, setPackets);
+  printf("outputs confirmed   %lu, unconfirmed %lu\n",
+         (unsigned long)latencies.size(), (unsigned long)pending.size());
+  if (!latencies.empty()) {
+    printf("confirm latency     %.0f ms mean, %lu ms p50, %lu ms p95, %lu ms max\n", mean,
+           latencies[latencies.size() / 2], latencies[latencies.size() * 95 / 100], latencies.back());
+  }
+  printf("library latency     %lu ms last, %lu ms max\n", ihc.getChangeLatency(), ihc.getMaxChangeLatency());
+  printf("polls sent          %lu, interval now %lu ms\n", polls, ihc.getPollingInterval());
+  printf("replies             %lu delivered, %lu received\n", repliesSent, repliesReceived);
+  printf("corrupt / noise     %lu packets / %lu bytes\n", framesCorrupted, noiseBytes);
+  printf("parser              %lu bytes parsed, %lu discarded\n", ihc.getBytesParsed(), ihc.getBytesDiscarded());
+  printf("queue               %lu dropped, %lu coalesced\n", ihc.getDropped(), ihc.getCoalesced());
+  printf("cpu                 %.0f ns per packet, %.0f ns max loop\n",
+         framesSent > 0 ? totalNs / framesSent : 0.0, maxNs);
+
+  // noise can swallow a reply that was delivered intact
+  boolean repliesLost = noise == 0 && repliesReceived < repliesSent;
+  return pending.empty() && !repliesLost ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+// =======================================
+// MOCK VECTOR FOR HOST BUILDS
+// =======================================
+// the subset of the Arduino Vector library that IHC uses,
+// a fixed size array owned by someone else
+
+#ifndef HOST_VECTOR_H
+#define HOST_VECTOR_H
+
+#include <stddef.h>
+
+template <typename T>
+class Vector {
+  public:
+    Vector() : values(NULL), maxSize(0), count(0) {}
+
+    template <size_t N>
+    Vector(T (&storage)[N], size_t size = 0) {
+      setStorage(storage, size);
+    }
+
+    template <size_t N>
+    void setStorage(T (&storage)[N], size_t size = 0) {
+      setStorage(storage, N, size);
+    }
+
+    void setStorage(T* storage, size_t max_size, size_t size) {
+      values = storage;
+      maxSize = max_size;
+      count = size;
+    }
+
+    T& operator[](size_t i) { return values[i]; }
+    const T& operator[](size_t i) const { return values[i]; }
+    T& at(size_t i) { return values[i]; }
+
+    void push_back(const T& value) {
+      if (count < maxSize) {
+        values[count++] = value;
+      }
+    }
+
+    void pop_back() {
+      if (count > 0) {
+        count--;
+      }
+    }
+
+    void remove(size_t i) {
+      for (size_t j = i + 1; j < count; j++) {
+        values[j - 1] = values[j];
+      }
+      count--;
+    }
+
+    void clear() { count = 0; }
+    size_t size() const { return count; }
+    size_t max_size() const { return maxSize; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == maxSize; }
+    T* data() { return values; }
+    T* begin() { return values; }
+    T* end() { return values + count; }
+
+  private:
+    T* values;
+    size_t maxSize;
+    size_t count;
+};
+
+#endif
@@ -1,17 +1,50 @@
 #include "IHC.h"
 
 IHCRS485Packet getOutputPacket(IHCDefs::ID_IHC, IHCDefs::GET_OUTPUTS);
+IHCRS485Packet getInputPacket(IHCDefs::ID_IHC, IHCDefs::GET_INPUTS);
 
 IHC::IHC()
+	: mpChangeCallback(NULL),
+	  mpSceneCallback(NULL)
 {
 }
 
 void IHC::init(SoftwareSerial *pSerial, bool debug)
 {
 	mDebug = debug;
-	mpSendPacket = NULL;
+	mSendHead = 0;
+	mSendCount = 0;
+	mDropped = 0;
+	mCoalesced = 0;
+	mParsed = 0;
+	mDiscarded = 0;
 	mLastPolled = millis();
+	mLastInputsPolled = mLastPolled;
+	mPollSent = mLastPolled;
+	mPollInterval = FAST_POLLING_INTERVAL;
+	mLastActivity = mLastPolled;
+	mLastStates = mLastPolled;
+	mLatencyStart = 0;
+	mLatencyPending = false;
+	mLatencySent = false;
+	mLatency = 0;
+	mMaxLatency = 0;
+	mPollOutputs = false;
 	mAvailable = false;
+	mWaitingReply = 0;
+	memset(mOutputs, 0, sizeof(mOutputs));
+	memset(mInputs, 0, sizeof(mInputs));
+	mOutputsKnown = false;
+	mInputsKnown = false;
+	memset(mSceneMask, 0, sizeof(mSceneMask));
+	memset(mSceneStates, 0, sizeof(mSceneStates));
+	mScenePending = false;
+	mSceneSent = false;
+	mRxState = RX_SYNC;
+	mRxCrc = 0;
+	mRxIndex = 0;
+	mpRxBuffer = mRxPackets[mRxIndex].getBuffer();
+	mpAvailablePacket = NULL;
 	mpSerial = pSerial;
 	mpSerial->begin(19200);
 
@@ -24,7 +57,7 @@ void IHC::init(SoftwareSerial *pSerial, bool debug)
 int IHC::getStatus()
 {
 	unsigned long now = millis();
-	if (now - mLastPolled > 60000)
+	if (now - mLastStates > STATUS_TIMEOUT)
 	{
 		return -1;
 	}
@@ -32,12 +65,27 @@ int IHC::getStatus()
 	return 1;
 }
 
+unsigned long IHC::getPollingInterval()
+{
+	return mPollInterval;
+}
+
+unsigned long IHC::getChangeLatency()
+{
+	return mLatency;
+}
+
+unsigned long IHC::getMaxChangeLatency()
+{
+	return mMaxLatency;
+}
+
 IHCRS485Packet *IHC::receive()
 {
 	if (mAvailable)
 	{
 		mAvailable = false;
-		return &mReceivedPacket;
+		return mpAvailablePacket;
 	}
 	else
 	{
@@ -45,123 +93,597 @@ IHCRS485Packet *IHC::receive()
 	}
 }
 
-void IHC::send(IHCRS485Packet *pPacket)
+bool IHC::send(IHCRS485Packet *pPacket)
 {
-	mpSendPacket = pPacket;
+	if (pPacket == NULL || !pPacket->isComplete())
+	{
+		return false;
+	}
+
+	// Last state of an output wins
+	IHCRS485Packet *pQueued = findQueuedOutput(pPacket);
+	if (pQueued != NULL)
+	{
+		pQueued->setData(pPacket->getID(), pPacket->getDataType(), pPacket->getData());
+		mCoalesced++;
+		return true;
+	}
+
+	if (mSendCount >= MAX_QUEUE_SIZE)
+	{
+		mDropped++;
+		if (mDebug)
+		{
+			Serial.println("IHC: Send queue full, packet dropped.");
+		}
+		return false;
+	}
+
+	// Packets hold their own storage, copy through setData()
+	IHCRS485Packet *pSlot = &mSendQueue[(mSendHead + mSendCount) % MAX_QUEUE_SIZE];
+	pSlot->setData(pPacket->getID(), pPacket->getDataType(), pPacket->getData());
+	mSendCount++;
+
+	if (!mLatencyPending)
+	{
+		mLatencyStart = millis();
+		mLatencyPending = true;
+	}
+	mLatencySent = false;
+
+	return true;
 }
 
-void IHC::loop()
+bool IHC::sendScene(const IHCOutputState *pOutputs, unsigned int count)
 {
-	// Clean start - make receiving buffers clean
-	purge();
+	if (pOutputs == NULL)
+	{
+		return false;
+	}
 
-	IHCRS485Packet *pPacket = readPacket();
-	//	if (pPacket->isComplete() && (pPacket->getID() == IHCDefs::ID_PC || pPacket->getID() == IHCDefs::ID_PC2))
-	if (pPacket->isComplete() && (pPacket->getID() == IHCDefs::ID_PC))
+	// Collect the outputs first, an output given twice is sent once
+	byte mask[IHC_MAX_MODULES];
+	byte states[IHC_MAX_MODULES];
+	int outputs = 0;
+	memset(mask, 0, sizeof(mask));
+	memset(states, 0, sizeof(states));
+	for (unsigned int i = 0; i < count; i++)
 	{
-		switch (pPacket->getDataType())
+		byte module = pOutputs[i].module;
+		byte port = pOutputs[i].port;
+		if (module < 1 || module > IHC_MAX_MODULES || port < 1 || port > IHC_MAX_PORTS)
 		{
-		case IHCDefs::ACK:
-			mAvailable = false;
-			break;
+			continue;
+		}
+
+		byte bit = 0x01 << (port - 1);
+		if (!(mask[module - 1] & bit))
+		{
+			outputs++;
+		}
+		mask[module - 1] |= bit;
+		states[module - 1] = pOutputs[i].state ? states[module - 1] | bit : states[module - 1] & ~bit;
+	}
+
+	if (outputs == 0)
+	{
+		return false;
+	}
+
+	int packets = (outputs + IHC_OUTPUTS_PER_PACKET - 1) / IHC_OUTPUTS_PER_PACKET;
+	if (mSendCount + packets > MAX_QUEUE_SIZE)
+	{
+		mDropped += packets;
+		if (mDebug)
+		{
+			Serial.println("IHC: Send queue full, scene dropped.");
+		}
+		return false;
+	}
 
-		case IHCDefs::DATA_READY:
-			mAvailable = false;
-			// Ready to write something to IHC
-			if (mpSendPacket != NULL)
+	IHCRS485Packet packet;
+	byte data[MAX_DATA_SIZE];
+	unsigned int size = 0;
+	for (byte mi = 0; mi < IHC_MAX_MODULES; mi++)
+	{
+		for (byte pi = 0; pi < IHC_MAX_PORTS; pi++)
+		{
+			byte bit = 0x01 << pi;
+			if (!(mask[mi] & bit))
 			{
-				// Send user message
-				writePacket(mpSendPacket);
-				mpSendPacket = NULL;
+				continue;
 			}
-			else
+
+			// Numbered like in changeOutput() of the sketches
+			data[size++] = mi * 10 + pi + 1;
+			data[size++] = (states[mi] & bit) ? 0x01 : 0x00;
+			if (size == IHC_OUTPUTS_PER_PACKET * 2)
 			{
-				unsigned long now = millis();
-				if (now - mLastPolled > POLLING_INTERVAL)
-				{
-					mLastPolled = now;
-					writePacket(&getOutputPacket);
-					readReply();
-				}
+				packet.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, data, size);
+				send(&packet);
+				size = 0;
 			}
-			break;
 		}
 	}
+	if (size > 0)
+	{
+		packet.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, data, size);
+		send(&packet);
+	}
+
+	for (byte mi = 0; mi < IHC_MAX_MODULES; mi++)
+	{
+		mSceneMask[mi] |= mask[mi];
+		mSceneStates[mi] = (mSceneStates[mi] & ~mask[mi]) | states[mi];
+	}
+	mScenePending = true;
+	mSceneSent = false;
+
+	return true;
+}
+
+bool IHC::isScenePending()
+{
+	return mScenePending;
+}
+
+void IHC::setSceneCallback(IHCSceneCallback callback)
+{
+	mpSceneCallback = callback;
 }
 
-void IHC::readReply()
+// The first OUTP_STATE after the scene was sent decides
+void IHC::checkScene()
 {
-	while (1)
+	if (!mScenePending || !mSceneSent)
+	{
+		return;
+	}
+
+	bool success = mOutputsKnown;
+	for (byte mi = 0; mi < IHC_MAX_MODULES; mi++)
 	{
-		if (millis() - mLastPolled > 5000)
+		if ((mOutputs[mi] & mSceneMask[mi]) != mSceneStates[mi])
 		{
-			return;
+			success = false;
 		}
+	}
+
+	memset(mSceneMask, 0, sizeof(mSceneMask));
+	memset(mSceneStates, 0, sizeof(mSceneStates));
+	mScenePending = false;
+
+	if (mDebug && !success)
+	{
+		Serial.println("IHC: Scene not confirmed.");
+	}
+
+	if (mpSceneCallback != NULL)
+	{
+		mpSceneCallback(success);
+	}
+}
+
+int IHC::getQueueDepth()
+{
+	return mSendCount;
+}
+
+unsigned long IHC::getDropped()
+{
+	return mDropped;
+}
+
+unsigned long IHC::getCoalesced()
+{
+	return mCoalesced;
+}
+
+unsigned long IHC::getBytesParsed()
+{
+	return mParsed;
+}
 
-		IHCRS485Packet *pPacket = readPacket();
-		if (pPacket->isComplete() && (pPacket->getID() == IHCDefs::ID_PC) && pPacket->getDataType() == IHCDefs::OUTP_STATE)
+unsigned long IHC::getBytesDiscarded()
+{
+	return mDiscarded;
+}
+
+void IHC::setChangeCallback(IHCChangeCallback callback)
+{
+	mpChangeCallback = callback;
+}
+
+bool IHC::getOutput(byte module, byte port)
+{
+	if (module < 1 || module > IHC_MAX_MODULES || port < 1 || port > IHC_MAX_PORTS)
+	{
+		return false;
+	}
+
+	return mOutputs[module - 1] & (0x01 << (port - 1));
+}
+
+bool IHC::getInput(byte module, byte port)
+{
+	if (module < 1 || module > IHC_MAX_MODULES || port < 1 || port > IHC_MAX_PORTS)
+	{
+		return false;
+	}
+
+	return mInputs[module - 1] & (0x01 << (port - 1));
+}
+
+// SET_OUTPUT data is the output number followed by its state
+IHCRS485Packet *IHC::findQueuedOutput(IHCRS485Packet *pPacket)
+{
+	const Vector<byte> *pData = pPacket->getData();
+	if (pPacket->getDataType() != IHCDefs::SET_OUTPUT || pData->size() != 2)
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < mSendCount; i++)
+	{
+		IHCRS485Packet *pQueued = &mSendQueue[(mSendHead + i) % MAX_QUEUE_SIZE];
+		const Vector<byte> *pQueuedData = pQueued->getData();
+		if (pQueued->getID() == pPacket->getID() &&
+			pQueued->getDataType() == IHCDefs::SET_OUTPUT &&
+			pQueuedData->size() == 2 && (*pQueuedData)[0] == (*pData)[0])
 		{
+			return pQueued;
+		}
+	}
+
+	return NULL;
+}
+
+void IHC::loop()
+{
+	if (mWaitingReply != 0 && millis() - mPollSent > REPLY_TIMEOUT)
+	{
+		mWaitingReply = 0;
+	}
+
+	// Handle everything that arrived since the last loop, bytes that
+	// do not fit in the budget wait in the serial buffer
+	int budget = MAX_BYTES_PER_LOOP;
+	while (readPacket(&budget))
+	{
+		IHCRS485Packet *pPacket = &mRxPackets[mRxIndex];
+		handlePacket(pPacket);
+
+		// Receive the next packet into the other buffer
+		if (mAvailable && mpAvailablePacket == pPacket)
+		{
+			mRxIndex = 1 - mRxIndex;
+			mpRxBuffer = mRxPackets[mRxIndex].getBuffer();
+		}
+	}
+}
+
+void IHC::handlePacket(IHCRS485Packet *pPacket)
+{
+	// States are tracked from all traffic, whoever asked for them
+	switch (pPacket->getDataType())
+	{
+	case IHCDefs::OUTP_STATE:
+		mLastStates = millis();
+		if (updateStates(true, pPacket->getPayload(), pPacket->getPayloadSize()))
+		{
+			speedUp();
+		}
+		if (mLatencyPending && mLatencySent)
+		{
+			mLatency = mLastStates - mLatencyStart;
+			if (mLatency > mMaxLatency)
+			{
+				mMaxLatency = mLatency;
+			}
+			mLatencyPending = false;
+		}
+		checkScene();
+		break;
+
+	case IHCDefs::INP_STATE:
+		mLastStates = millis();
+		// An input may have switched an output
+		if (updateStates(false, pPacket->getPayload(), pPacket->getPayloadSize()))
+		{
+			mPollOutputs = true;
+			speedUp();
+		}
+		break;
+
+	case IHCDefs::ACT_INPUT:
+		// Input number and state, numbered like outputs in SET_OUTPUT
+		if (pPacket->getPayloadSize() >= 2)
+		{
+			byte number = pPacket->getPayload()[0];
+			if (updateState(false, number / 10 + 1, number % 10, pPacket->getPayload()[1] != 0x00))
+			{
+				mPollOutputs = true;
+				speedUp();
+			}
+		}
+		break;
+	}
+
+	//	if (pPacket->getID() == IHCDefs::ID_PC || pPacket->getID() == IHCDefs::ID_PC2)
+	if (pPacket->getID() != IHCDefs::ID_PC)
+	{
+		return;
+	}
+
+	if (mWaitingReply != 0)
+	{
+		// Only the reply to our poll is of interest
+		if (pPacket->getDataType() == mWaitingReply)
+		{
+			mWaitingReply = 0;
 			mAvailable = true;
-			return;
+			mpAvailablePacket = pPacket;
 		}
+		return;
 	}
+
+	// A reply stays available until receive() takes it or the next
+	// reply replaces it, later tokens do not clear it
+	switch (pPacket->getDataType())
+	{
+	case IHCDefs::DATA_READY:
+		// Ready to write something to IHC
+		if (mSendCount > 0)
+		{
+			// Send the oldest user message
+			writePacket(&mSendQueue[mSendHead]);
+			mSendHead = (mSendHead + 1) % MAX_QUEUE_SIZE;
+			mSendCount--;
+			mLatencySent = mSendCount == 0;
+			speedUp();
+			if (mScenePending && mSendCount == 0)
+			{
+				// Confirm the scene at the next DATA_READY
+				mSceneSent = true;
+				mPollOutputs = true;
+			}
+		}
+		else
+		{
+			// A reply that was not read is replaced by the next one
+			unsigned long now = millis();
+			if (mPollOutputs || now - mLastPolled > mPollInterval)
+			{
+				// Back off while the house is idle
+				if (now - mLastActivity > FAST_POLLING_WINDOW)
+				{
+					mPollInterval = mPollInterval * 2 < POLLING_INTERVAL ? mPollInterval * 2 : POLLING_INTERVAL;
+				}
+				mLastPolled = now;
+				mPollSent = now;
+				mPollOutputs = false;
+				writePacket(&getOutputPacket);
+				mWaitingReply = IHCDefs::OUTP_STATE;
+			}
+			else if (now - mLastInputsPolled > POLLING_INTERVAL)
+			{
+				mLastInputsPolled = now;
+				mPollSent = now;
+				writePacket(&getInputPacket);
+				mWaitingReply = IHCDefs::INP_STATE;
+			}
+		}
+		break;
+	}
+}
+
+// Poll outputs often for a while after a command or a change
+void IHC::speedUp()
+{
+	mLastActivity = millis();
+	mPollInterval = FAST_POLLING_INTERVAL;
 }
 
-IHCRS485Packet *IHC::readPacket()
+// One byte per module, bit 0 is port 1
+// Only the ports that changed are reported, all of them the first time
+// Returns true if any port changed
+bool IHC::updateStates(bool isOutput, const byte *pStates, unsigned int size)
 {
-	byte storage[MAX_PACKET_SIZE];
-	Vector<byte> buffer(storage);
+	byte *pKnown = isOutput ? mOutputs : mInputs;
+	bool *pIsKnown = isOutput ? &mOutputsKnown : &mInputsKnown;
+	bool ret = false;
 
-	byte c = readByte();
-	while (c != IHCDefs::STX)
+	for (unsigned int mi = 0; mi < size && mi < IHC_MAX_MODULES; mi++)
 	{
-		// Discard bytes and sync with STX
-		c = readByte();
+		byte changed = *pIsKnown ? pKnown[mi] ^ pStates[mi] : 0xFF;
+		pKnown[mi] = pStates[mi];
+		ret = ret || changed != 0x00;
+		if (changed != 0x00 && mpChangeCallback != NULL)
+		{
+			for (byte pi = 0; pi < IHC_MAX_PORTS; pi++)
+			{
+				if (changed & (0x01 << pi))
+				{
+					mpChangeCallback(isOutput, mi + 1, pi + 1, pStates[mi] & (0x01 << pi));
+				}
+			}
+		}
 	}
 
-	buffer.push_back(c); // STX
+	*pIsKnown = true;
+	return ret;
+}
 
-	for (int i = 1; i < MAX_PACKET_SIZE; i++)
+bool IHC::updateState(bool isOutput, byte module, byte port, bool state)
+{
+	if (module < 1 || module > IHC_MAX_MODULES || port < 1 || port > IHC_MAX_PORTS)
 	{
-		c = readByte();
-		buffer.push_back(c);
-		if (c == IHCDefs::ETB)
+		return false;
+	}
+
+	byte *pKnown = isOutput ? &mOutputs[module - 1] : &mInputs[module - 1];
+	byte mask = 0x01 << (port - 1);
+	if (((*pKnown & mask) != 0) != state)
+	{
+		*pKnown ^= mask;
+		if (mpChangeCallback != NULL)
 		{
-			c = readByte();
-			buffer.push_back(c); // CRC
-			break;
+			mpChangeCallback(isOutput, module, port, state);
 		}
+		return true;
 	}
 
-	mReceivedPacket.fromBuffer(&buffer);
+	return false;
+}
 
-	if (mDebug)
+// Reads bytes that are already available, at most *pBudget of them
+// Returns true when they completed a valid packet
+bool IHC::readPacket(int *pBudget)
+{
+	while (*pBudget > 0 && mpSerial->available() > 0)
 	{
-		Serial.println("Received ==>");
-		mReceivedPacket.prettyPrint();
-		Serial.println("<== Received");
+		(*pBudget)--;
+		if (readByte(mpSerial->read()))
+		{
+			// Validated in place, nothing is copied
+			IHCRS485Packet *pPacket = &mRxPackets[mRxIndex];
+			bool isComplete = pPacket->parse();
+
+			if (mDebug)
+			{
+				Serial.println("Received ==>");
+				pPacket->prettyPrint();
+				Serial.println("<== Received");
+			}
+
+			if (isComplete)
+			{
+				mParsed += mpRxBuffer->size();
+				return true;
+			}
+
+			mDiscarded += mpRxBuffer->size();
+		}
 	}
 
-	return &mReceivedPacket;
+	return false;
 }
 
-byte IHC::readByte()
+// Feeds one byte to the receive state machine
+// Returns true when the byte completed a packet
+bool IHC::readByte(byte c)
 {
-	while (true)
+	switch (mRxState)
 	{
-		if (mpSerial->available() > 0)
+	case RX_SYNC:
+		// Discard bytes and sync with STX
+		if (c == IHCDefs::STX)
+		{
+			mpRxBuffer->clear();
+			mpRxBuffer->push_back(c);
+			mRxCrc = c;
+			mRxState = RX_ID;
+		}
+		else
 		{
-			return mpSerial->read();
+			mDiscarded++;
 		}
-//		delay(10);
+		break;
+
+	case RX_ID:
+		mpRxBuffer->push_back(c);
+		mRxCrc += c;
+		mRxState = RX_TYPE;
+		break;
+
+	case RX_TYPE:
+		mpRxBuffer->push_back(c);
+		mRxCrc += c;
+		mRxState = RX_DATA;
+		break;
+
+	case RX_DATA:
+	case RX_CRC:
+		// A data byte may equal ETB, the packet ends only when the byte
+		// after ETB is the CRC. A data byte 0x17 followed by a byte that
+		// happens to equal the sum so far (1 in 256) still ends the packet
+		// early. The CRC of that shorter packet is then valid too, so it is
+		// taken as is: its payload is the data before the 0x17, e.g. the
+		// first modules of an OUTP_STATE with correct states, and the rest
+		// of the packet is discarded while syncing to the next STX.
+		if (mRxState == RX_CRC)
+		{
+			if (c == mRxCrc)
+			{
+				mpRxBuffer->push_back(c);
+				mRxState = RX_SYNC;
+				return true;
+			}
+
+			// A packet with a bad CRC does not end, the packets after it
+			// are received as its data. One of them may end here
+			byte sum = 0;
+			for (unsigned int i = 0; i + MIN_PACKET_SIZE - 1 <= mpRxBuffer->size(); i++)
+			{
+				if (i > 0 && (*mpRxBuffer)[i] == IHCDefs::STX && (byte)(mRxCrc - sum) == c)
+				{
+					dropRxBytes(i);
+					mpRxBuffer->push_back(c);
+					mRxState = RX_SYNC;
+					return true;
+				}
+				sum += (*mpRxBuffer)[i];
+			}
+		}
+		if (mpRxBuffer->size() >= MAX_PACKET_SIZE - 1)
+		{
+			// No room for ETB and CRC, continue from the next STX in the
+			// buffer or from this byte
+			unsigned int next = 1;
+			while (next < mpRxBuffer->size() && (*mpRxBuffer)[next] != IHCDefs::STX)
+			{
+				next++;
+			}
+			dropRxBytes(next);
+			return readByte(c);
+		}
+		mpRxBuffer->push_back(c);
+		mRxCrc += c;
+		mRxState = c == IHCDefs::ETB ? RX_CRC : RX_DATA;
+		break;
 	}
+
+	return false;
 }
 
-void IHC::purge()
+// Discards the first count bytes of the packet being received, the rest
+// starts with STX or is empty
+void IHC::dropRxBytes(unsigned int count)
 {
-	while (mpSerial->available() > 0)
+	unsigned int size = mpRxBuffer->size() - count;
+	mDiscarded += count;
+	mRxCrc = 0;
+	for (unsigned int i = 0; i < size; i++)
+	{
+		(*mpRxBuffer)[i] = (*mpRxBuffer)[i + count];
+		mRxCrc += (*mpRxBuffer)[i];
+	}
+	for (unsigned int i = 0; i < count; i++)
+	{
+		mpRxBuffer->pop_back();
+	}
+
+	if (size == 0)
+	{
+		mRxState = RX_SYNC;
+	}
+	else if (size < 3)
+	{
+		mRxState = size == 1 ? RX_ID : RX_TYPE;
+	}
+	else
 	{
-		mpSerial->read();
+		mRxState = (*mpRxBuffer)[size - 1] == IHCDefs::ETB ? RX_CRC : RX_DATA;
 	}
 }
 
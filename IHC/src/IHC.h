@@ -6,7 +6,28 @@
 #include "IHCRS485Packet.h"
 
 #define MAX_QUEUE_SIZE 10
-#define POLLING_INTERVAL 10000
+#define POLLING_INTERVAL 30000 // Longest interval, changes are reported as they are seen
+#define FAST_POLLING_INTERVAL 1000 // Outputs after a command or a change
+#define FAST_POLLING_WINDOW 10000 // Then the interval doubles up to POLLING_INTERVAL
+#define REPLY_TIMEOUT 5000
+#define STATUS_TIMEOUT (2 * POLLING_INTERVAL + REPLY_TIMEOUT)
+#define MAX_BYTES_PER_LOOP 64
+#define IHC_MAX_MODULES MAX_DATA_SIZE // One state byte per module
+#define IHC_MAX_PORTS 8
+#define IHC_OUTPUTS_PER_PACKET (MAX_DATA_SIZE / 2) // SET_OUTPUT number and state pairs
+
+// Called when an output or input changes, modules and ports start from 1
+typedef void (*IHCChangeCallback)(bool isOutput, byte module, byte port, bool state);
+
+// Called when the first OUTP_STATE after a scene was sent confirms it or not
+typedef void (*IHCSceneCallback)(bool success);
+
+struct IHCOutputState
+{
+	byte module;
+	byte port;
+	bool state;
+};
 
 class IHC
 {
@@ -14,23 +35,101 @@ public:
 	IHC();
 	void init(SoftwareSerial *pSerial, bool debug);
 	void loop();
+	// The reply to the last poll, kept until it is read or replaced by the
+	// next reply. Polling does not depend on it being read
 	IHCRS485Packet *receive();
-	void send(IHCRS485Packet *pPacket);
+	// Queues a copy of the packet, one is sent per DATA_READY
+	// A queued SET_OUTPUT of the same output is replaced by the new one
+	// Returns false if the queue is full and the packet was dropped
+	bool send(IHCRS485Packet *pPacket);
+	// Sets the outputs with as few SET_OUTPUT packets as possible, the last
+	// state of an output wins. A scene sent while another one is pending is
+	// merged to it. Returns false if the packets do not fit in the queue
+	bool sendScene(const IHCOutputState *pOutputs, unsigned int count);
+	bool isScenePending();
+	void setSceneCallback(IHCSceneCallback callback);
+	// -1 if no states have been seen in STATUS_TIMEOUT
 	int getStatus();
+	unsigned long getPollingInterval();
+	// Time from queueing a command to the OUTP_STATE after it was sent
+	unsigned long getChangeLatency();
+	unsigned long getMaxChangeLatency();
+	int getQueueDepth();
+	unsigned long getDropped();
+	unsigned long getCoalesced();
+	// Bytes of valid packets and bytes skipped while syncing or in bad packets
+	unsigned long getBytesParsed();
+	unsigned long getBytesDiscarded();
+	// Outputs and inputs as last seen in the bus
+	void setChangeCallback(IHCChangeCallback callback);
+	bool getOutput(byte module, byte port);
+	bool getInput(byte module, byte port);
 
 private:
-	IHCRS485Packet *readPacket();
+	// Receive states, a packet is STX ID TYPE DATA... ETB CRC
+	// A packet that does not end is rescanned from its next STX, so a bad
+	// CRC does not cost the packets received after it
+	enum RxState
+	{
+		RX_SYNC,
+		RX_ID,
+		RX_TYPE,
+		RX_DATA,
+		RX_CRC
+	};
+
+	bool readPacket(int *pBudget);
+	bool readByte(byte c);
+	void dropRxBytes(unsigned int count);
+	void handlePacket(IHCRS485Packet *pPacket);
 	void writePacket(IHCRS485Packet *pPacket);
-	void readReply();
-	byte readByte();
-	void purge();
+	void speedUp();
+	bool updateStates(bool isOutput, const byte *pStates, unsigned int size);
+	bool updateState(bool isOutput, byte module, byte port, bool state);
+	void checkScene();
+	IHCRS485Packet *findQueuedOutput(IHCRS485Packet *pPacket);
 
 	bool mDebug;
 	SoftwareSerial *mpSerial;
-	IHCRS485Packet mReceivedPacket;
-	IHCRS485Packet *mpSendPacket;
+	// Bytes are received straight into one of the packets, the other one
+	// keeps the packet that receive() returns until it has been read
+	IHCRS485Packet mRxPackets[2];
+	int mRxIndex;
+	IHCRS485Packet *mpAvailablePacket;
+	IHCRS485Packet mSendQueue[MAX_QUEUE_SIZE];
+	int mSendHead;
+	int mSendCount;
+	unsigned long mDropped;
+	unsigned long mCoalesced;
+	unsigned long mParsed;
+	unsigned long mDiscarded;
 	unsigned long mLastPolled;
+	unsigned long mLastInputsPolled;
+	unsigned long mPollSent;
+	unsigned long mPollInterval;
+	unsigned long mLastActivity; // Last command or change
+	unsigned long mLastStates;
+	unsigned long mLatencyStart;
+	bool mLatencyPending;
+	bool mLatencySent; // All commands since mLatencyStart have been sent
+	unsigned long mLatency;
+	unsigned long mMaxLatency;
+	bool mPollOutputs; // An input changed, poll outputs at the next DATA_READY
 	bool mAvailable;
+	byte mWaitingReply; // OUTP_STATE or INP_STATE, 0 if none
+	IHCChangeCallback mpChangeCallback;
+	byte mOutputs[IHC_MAX_MODULES];
+	byte mInputs[IHC_MAX_MODULES];
+	bool mOutputsKnown;
+	bool mInputsKnown;
+	IHCSceneCallback mpSceneCallback;
+	byte mSceneMask[IHC_MAX_MODULES]; // Outputs of the pending scene
+	byte mSceneStates[IHC_MAX_MODULES];
+	bool mScenePending;
+	bool mSceneSent; // All packets of the scene have been sent
+	RxState mRxState;
+	byte mRxCrc; // Sum of the bytes received so far
+	Vector<byte> *mpRxBuffer;
 };
 
 #endif /* IHC_H */
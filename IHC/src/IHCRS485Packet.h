@@ -3,6 +3,7 @@
 #include <Vector.h>
 
 #define MAX_PACKET_SIZE 21
+#define MIN_PACKET_SIZE 5
 #define MAX_DATA_SIZE 16
 
 namespace IHCDefs
@@ -31,98 +32,169 @@ const byte ID_PC = 0x1C;
 const byte ID_PC2 = 0x1D;
 }; // namespace IHCDefs
 
+// Read only view of a packet in a buffer owned by someone else
+// Nothing is copied, the buffer must stay unchanged while the view is used
+class IHCRS485PacketView
+{
+public:
+	IHCRS485PacketView()
+		: mpBuffer(NULL),
+		  mSize(0),
+		  mIsComplete(false)
+	{
+	};
+
+	// Checks the framing and the CRC in one pass
+	bool parse(const byte *pBuffer, unsigned int size)
+	{
+		mpBuffer = pBuffer;
+		mSize = size;
+		mIsComplete = false;
+
+		// STX ID TYPE DATA... ETB CRC
+		if (pBuffer == NULL || size < MIN_PACKET_SIZE || size > MAX_PACKET_SIZE || pBuffer[0] != IHCDefs::STX)
+		{
+			return false;
+		}
+
+		byte crc = 0x00;
+		for (unsigned int i = 0; i < size - 1; i++)
+		{
+			crc += pBuffer[i];
+		}
+
+		mIsComplete = pBuffer[size - 2] == IHCDefs::ETB && pBuffer[size - 1] == crc;
+		return mIsComplete;
+	};
+
+	bool isComplete()
+	{
+		return mIsComplete;
+	};
+
+	byte getID()
+	{
+		return mSize > 1 ? mpBuffer[1] : 0x00;
+	};
+
+	byte getDataType()
+	{
+		return mSize > 2 ? mpBuffer[2] : 0x00;
+	};
+
+	const byte *getPayload()
+	{
+		return mIsComplete ? &mpBuffer[3] : NULL;
+	};
+
+	unsigned int getPayloadSize()
+	{
+		return mIsComplete ? mSize - MIN_PACKET_SIZE : 0;
+	};
+
+private:
+	const byte *mpBuffer;
+	unsigned int mSize;
+	bool mIsComplete;
+};
+
+// Packet with its own storage
+// The payload returned by getData() is a view to the same storage
 class IHCRS485Packet
 {
 public:
 	IHCRS485Packet()
-		: mId(0x00),
-		  mDataType(0x00),
-		  mIsComplete(false)
+		: mIsComplete(false)
 	{
 		mPacket.setStorage(mPacketStorage);
-		mData.setStorage(mDataStorage);
+		mData.setStorage(&mPacketStorage[3], MAX_DATA_SIZE, 0);
 	};
 
 	IHCRS485Packet(byte id,
 				   byte dataType)
 	{
 		mPacket.setStorage(mPacketStorage);
-		mData.setStorage(mDataStorage);
-
 		setData(id, dataType, NULL);
 	};
 
+	IHCRS485Packet(const IHCRS485Packet &other)
+	{
+		mPacket.setStorage(mPacketStorage);
+		*this = other;
+	};
+
+	// The vectors must keep pointing to our own storage
+	IHCRS485Packet &operator=(const IHCRS485Packet &other)
+	{
+		if (this != &other)
+		{
+			memcpy(mPacketStorage, other.mPacketStorage, other.mPacket.size());
+			mPacket.setStorage(mPacketStorage, MAX_PACKET_SIZE, other.mPacket.size());
+			parse();
+		}
+		return *this;
+	};
+
 	void fromBuffer(Vector<byte> *pBuffer)
 	{
+		mPacket.clear();
 		if (pBuffer != NULL)
 		{
-			mIsComplete = false;
-			mPacket.clear();
-			mData.clear();
-
-			if (pBuffer->size() > 2 && (*pBuffer)[0] == IHCDefs::STX)
+			for (unsigned int j = 0; j < pBuffer->size() && j < MAX_PACKET_SIZE; j++)
 			{
-				mId = (*pBuffer)[1];
-				mDataType = (*pBuffer)[2];
-				byte crc = 0x00;
-				for (unsigned int j = 0; j < 3; j++)
-				{
-					crc += (*pBuffer)[j];
-					mPacket.push_back((*pBuffer)[j]);
-				}
-				for (unsigned int j = 3; j < pBuffer->size(); j++)
-				{
-					crc += (*pBuffer)[j];
-					mPacket.push_back((*pBuffer)[j]);
-					if ((*pBuffer)[j] != IHCDefs::ETB)
-					{
-						mData.push_back((*pBuffer)[j]);
-					}
-					else
-					{
-						if ((j + 1) == (pBuffer->size() - 1))
-						{
-							if ((*pBuffer)[j + 1] == (byte)(crc & 0xFF))
-							{
-								mPacket.push_back((*pBuffer)[j + 1]);
-								mIsComplete = true;
-								break;
-							}
-						}
-					}
-				}
+				mPacket.push_back((*pBuffer)[j]);
 			}
 		}
+
+		parse();
 	};
 
-	void setData(byte id, byte dataType, Vector<byte> *pData)
+	// Validates the bytes in getBuffer() in place
+	bool parse()
 	{
-		mId = id;
-		mDataType = dataType;
+		IHCRS485PacketView view;
+		mIsComplete = view.parse(mPacketStorage, mPacket.size());
+		mData.setStorage(&mPacketStorage[3], MAX_DATA_SIZE, view.getPayloadSize());
+		return mIsComplete;
+	};
 
-		mPacket.clear();
-		mData.clear();
+	void setData(byte id, byte dataType, const Vector<byte> *pData)
+	{
+		if (pData != NULL)
+		{
+			setData(id, dataType, &(*pData)[0], pData->size());
+		}
+		else
+		{
+			setData(id, dataType, NULL, 0);
+		}
+	};
+
+	void setData(byte id, byte dataType, const byte *pData, unsigned int size)
+	{
+		if (size > MAX_DATA_SIZE)
+		{
+			size = MAX_DATA_SIZE;
+		}
 
+		mPacket.clear();
 		mPacket.push_back(IHCDefs::STX);
 		mPacket.push_back(id);
 		mPacket.push_back(dataType);
-
-		if (pData != NULL)
+		for (unsigned int i = 0; i < size; i++)
 		{
-			for (unsigned int i = 0; i < pData->size(); i++)
-			{
-				mPacket.push_back((*pData)[i]);
-				mData.push_back((*pData)[i]);
-			}
+			mPacket.push_back(pData[i]);
 		}
-
 		mPacket.push_back(IHCDefs::ETB);
+
 		byte crc = 0;
 		for (unsigned int icrc = 0; icrc < mPacket.size(); icrc++)
 		{
 			crc += mPacket[icrc];
 		}
 		mPacket.push_back((byte)(crc & 0xFF));
+
+		mData.setStorage(&mPacketStorage[3], MAX_DATA_SIZE, size);
 		mIsComplete = true;
 	}
 
@@ -146,7 +218,7 @@ public:
 	void prettyPrint()
 	{
 		String receiver;
-		switch (mId)
+		switch (getID())
 		{
 		case IHCDefs::ID_MODEM:
 			receiver = "MODEM";
@@ -173,7 +245,7 @@ public:
 		Serial.print("Receiver: ");
 		Serial.println(receiver.c_str());
 		Serial.print("Data type: ");
-		Serial.println(mDataType, HEX);
+		Serial.println(getDataType(), HEX);
 		Serial.print("Is complete: ");
 		Serial.println(mIsComplete);
 		printVector(&mPacket);
@@ -184,34 +256,43 @@ public:
 		return mIsComplete;
 	};
 
+	// Raw bytes, write a received packet here and call parse()
 	Vector<byte> *getBuffer()
 	{
 		return &mPacket;
 	};
 
-	Vector<byte> *getData()
+	// Payload, read only
+	const Vector<byte> *getData()
 	{
 		return &mData;
 	};
 
+	const byte *getPayload()
+	{
+		return &mPacketStorage[3];
+	};
+
+	unsigned int getPayloadSize()
+	{
+		return mData.size();
+	};
+
 	byte getID()
 	{
-		return mId;
+		return mPacket.size() > 1 ? mPacketStorage[1] : 0x00;
 	};
 
 	byte getDataType()
 	{
-		return mDataType;
+		return mPacket.size() > 2 ? mPacketStorage[2] : 0x00;
 	};
 
 private:
-	byte mId;
-	byte mDataType;
 	bool mIsComplete;
 	Vector<byte> mPacket;
-	byte mPacketStorage[MAX_PACKET_SIZE];
 	Vector<byte> mData;
-	byte mDataStorage[MAX_DATA_SIZE];
+	byte mPacketStorage[MAX_PACKET_SIZE];
 };
 
 #endif /* IHCRS485PACKET_H */
@@ -1,137 +1,143 @@
 #ifndef IHCCONFIG_H
 #define IHCCONFIG_H
 
-#include <IHCIO.h>
-
 #define MAX_MODULES 16
 #define MAX_PORTS 8
-#define SIZE sizeof(ios)/sizeof(ios[0])
+#define NAME_SIZE 20
+#define SIZE (sizeof(names) / sizeof(names[0]))
 
 byte vectorStorage[MAX_MODULES];
 Vector<byte> data;
 
-IHCIO kitchenStove("hella", 1, 1);
-IHCIO porch("kuisti", 1, 2);
-IHCIO entry("tuulikaappi", 1, 3);
-IHCIO boiler("KV varaaja", 1, 4);
-IHCIO hall("AK halli", 1, 5);
-IHCIO bay("erkkeri", 1, 6);
-IHCIO hallCeilingSocket("AK hallin KPR", 1, 8);
-IHCIO UtilityRoom("KHH", 2, 1);
-IHCIO masterBathroom("AK WC", 2, 2);
-IHCIO kitchenCabinets("keittion kaapit", 2, 3);
-IHCIO kitchen("keittio", 2, 4);
-IHCIO kitchenCeilingSocket("keittio KPR", 2, 5);
-IHCIO livingroomCeilingSocket("OH KPR", 2, 6);
-IHCIO socketsDownstairs("AK PR", 3, 2);
-IHCIO stairs("portaat", 3, 3);
-IHCIO ovaali("ovaali", 3, 4);
-IHCIO terrace("terassi", 3, 6);
-IHCIO smallBedroom("pieni lasten MH", 3, 7);
-IHCIO door("ovi", 3, 8);
-IHCIO officeCeilingSocket("TH KPR", 4, 1);
-IHCIO office("TH", 4, 3);
-IHCIO saunaFiber("saunan kuitu", 4, 4);
-IHCIO washingRoom("PH", 4, 5);
-IHCIO saunaWall("saunan lauteet", 4, 6);
-IHCIO smallBedroomCeilingSocket("pieni lasten MH KPR", 4, 7);
-IHCIO livingroomDimmer("OH himmennin", 5, 1);
-IHCIO bigBedroomCeilingSocket("iso lasten MH KPR", 5, 2);
-IHCIO hallUpstairs("YK halli", 5, 4);
-IHCIO hallUpstairsCeilingSocket("YK halli KPR", 5, 5);
-IHCIO masterBedroom("iso MH", 5, 7);
-IHCIO masterBedroomWall("iso MH seina", 6, 1);
-IHCIO bigBedroom("iso lasten MH", 6, 3);
-IHCIO bathroomCabinet("YK WC peili", 6, 4);
-IHCIO bathroom("YK WC", 6, 5);
-IHCIO socketsUpstairs("YK PR", 6, 7);
-IHCIO yard("piha", 7, 1);
-IHCIO outerWall("ulkoseina", 7, 2);
-IHCIO home("kotona", 7, 3);
-IHCIO alarm("halytys", 7, 4);
-IHCIO security("haly viritetty", 8, 2);
-IHCIO program("ohjelmointi", 8, 4);
-
-IHCIO ios[] = {
-  kitchenStove,
-  porch,
-  entry,
-  boiler,
-  hall,
-  bay,
-  hallCeilingSocket,
-  UtilityRoom,
-  masterBathroom,
-  kitchenCabinets,
-  kitchen,
-  kitchenCeilingSocket,
-  livingroomCeilingSocket,
-  socketsDownstairs,
-  stairs,
-  ovaali,
-  terrace,
-  smallBedroom,
-  door,
-  officeCeilingSocket,
-  office,
-  saunaFiber,
-  washingRoom,
-  saunaWall,
-  smallBedroomCeilingSocket,
-  livingroomDimmer,
-  bigBedroomCeilingSocket,
-  hallUpstairs,
-  hallUpstairsCeilingSocket,
-  masterBedroom,
-  masterBedroomWall,
-  bigBedroom,
-  bathroomCabinet,
-  bathroom,
-  socketsUpstairs,
-  yard,
-  outerWall,
-  home,
-  alarm,
-  security,
-  program
+struct IHCName
+{
+  byte module;
+  byte port;
+  bool isOutput;
+  char name[NAME_SIZE];
+};
+
+// Names stay in flash, read them with memcpy_P()
+const IHCName names[] PROGMEM = {
+  {1, 1, true, "hella"},
+  {1, 2, true, "kuisti"},
+  {1, 3, true, "tuulikaappi"},
+  {1, 4, true, "KV varaaja"},
+  {1, 5, true, "AK halli"},
+  {1, 6, true, "erkkeri"},
+  {1, 8, true, "AK hallin KPR"},
+  {2, 1, true, "KHH"},
+  {2, 2, true, "AK WC"},
+  {2, 3, true, "keittion kaapit"},
+  {2, 4, true, "keittio"},
+  {2, 5, true, "keittio KPR"},
+  {2, 6, true, "OH KPR"},
+  {3, 2, true, "AK PR"},
+  {3, 3, true, "portaat"},
+  {3, 4, true, "ovaali"},
+  {3, 6, true, "terassi"},
+  {3, 7, true, "pieni lasten MH"},
+  {3, 8, true, "ovi"},
+  {4, 1, true, "TH KPR"},
+  {4, 3, true, "TH"},
+  {4, 4, true, "saunan kuitu"},
+  {4, 5, true, "PH"},
+  {4, 6, true, "saunan lauteet"},
+  {4, 7, true, "pieni lasten MH KPR"},
+  {5, 1, true, "OH himmennin"},
+  {5, 2, true, "iso lasten MH KPR"},
+  {5, 4, true, "YK halli"},
+  {5, 5, true, "YK halli KPR"},
+  {5, 7, true, "iso MH"},
+  {6, 1, true, "iso MH seina"},
+  {6, 3, true, "iso lasten MH"},
+  {6, 4, true, "YK WC peili"},
+  {6, 5, true, "YK WC"},
+  {6, 7, true, "YK PR"},
+  {7, 1, true, "piha"},
+  {7, 2, true, "ulkoseina"},
+  {7, 3, true, "kotona"},
+  {7, 4, true, "halytys"},
+  {8, 2, true, "haly viritetty"},
+  {8, 4, true, "ohjelmointi"},
 };
 
-IHCIO *findIO(unsigned short module, unsigned short port)
+// Named ports that changed and are not published yet, bit 0 is port 1.
+// The states themselves are kept by the IHC library
+byte outputDirty[MAX_MODULES];
+byte inputDirty[MAX_MODULES];
+
+// names[] index + 1 by module and port, 0 if the port has no name
+byte outputNames[MAX_MODULES][MAX_PORTS];
+byte inputNames[MAX_MODULES][MAX_PORTS];
+bool namesIndexed = false;
+
+static_assert(SIZE < 0xFF, "names[] index must fit in a byte");
+
+void indexNames()
 {
-  for (int i = 0; i < SIZE; i++)
+  memset(outputNames, 0, sizeof(outputNames));
+  memset(inputNames, 0, sizeof(inputNames));
+  // Keep the first match
+  for (int i = SIZE - 1; i >= 0; i--)
   {
-    if (ios[i].getModule() == module && ios[i].getPort() == port)
+    IHCName name;
+    memcpy_P(&name, &names[i], sizeof(IHCName));
+    if (name.module >= 1 && name.module <= MAX_MODULES && name.port >= 1 && name.port <= MAX_PORTS)
     {
-      return &ios[i];
+      if (name.isOutput)
+      {
+        outputNames[name.module - 1][name.port - 1] = i + 1;
+      }
+      else
+      {
+        inputNames[name.module - 1][name.port - 1] = i + 1;
+      }
     }
   }
+  namesIndexed = true;
+}
 
-  return NULL;
-};
+// names[] index + 1, 0 if the port has no name
+byte findNameIndex(unsigned short module, unsigned short port, bool isOutput)
+{
+  if (module < 1 || module > MAX_MODULES || port < 1 || port > MAX_PORTS)
+  {
+    return 0;
+  }
 
-unsigned long updateStates(Vector<byte> *pNewData)
+  if (!namesIndexed)
+  {
+    indexNames();
+  }
+
+  return isOutput ? outputNames[module - 1][port - 1] : inputNames[module - 1][port - 1];
+}
+
+// Copies the name of the port to pName, returns false if it has none
+bool findName(unsigned short module, unsigned short port, bool isOutput, char *pName)
 {
-  unsigned long ret = 0;
-  unsigned long changeId = millis();
-  if (pNewData != NULL) {
-    for (unsigned short mi = 0; mi < pNewData->size(); mi++)
-    {
-      byte moduleByte = (*pNewData)[mi];
-      for (unsigned short pi = 0; pi < MAX_PORTS; pi++)
-      {
-        bool state = moduleByte & (0x1 << pi);
-        IHCIO *io = findIO(mi + 1, pi + 1);
-        if (io != NULL)
-        {
-          if (io->setState(state, changeId)) {
-            ret = changeId;
-          }
-        }
-      }
-    }
+  byte index = findNameIndex(module, port, isOutput);
+  if (index == 0)
+  {
+    return false;
+  }
+
+  memcpy_P(pName, names[index - 1].name, NAME_SIZE);
+  return true;
+}
+
+// Only named ports are published, returns false if the port has no name
+bool markDirty(unsigned short module, unsigned short port, bool isOutput)
+{
+  if (findNameIndex(module, port, isOutput) == 0)
+  {
+    return false;
   }
 
-  return ret;
+  byte *pDirty = isOutput ? outputDirty : inputDirty;
+  pDirty[module - 1] |= 0x1 << (port - 1);
+  return true;
 }
 
 Vector<byte> *changeOutput(unsigned short module, unsigned short port, bool state) {
@@ -9,7 +9,8 @@
 #include "xCredentials.h"
 
 #define OUTPUT_BUFFER_LENGTH 500
-#define INPUT_BUFFER_LENGTH 300
+#define INPUT_BUFFER_LENGTH 800
+#define MAX_SCENE_SIZE 32
 #define DEBUG 1
 #define DEBUG_IHC 0
 
@@ -26,7 +27,6 @@ WiFiClientSecure espClient;
 PubSubClient client(AWS_endpoint, 8883, callback, espClient);
 SoftwareSerial sws(4, 5);
 IHC ihc;
-IHCRS485Packet sendPacket;
 unsigned long pulse_duration = 0;
 unsigned short pulse_module = 0;
 unsigned short pulse_port = 0;
@@ -96,6 +96,8 @@ void setup() {
 
   Serial.print("Heap: "); Serial.println(ESP.getFreeHeap());
 
+  ihc.setChangeCallback(ioChanged);
+  ihc.setSceneCallback(sceneDone);
   ihc.init(&sws, DEBUG_IHC);
 
   if (DEBUG) {
@@ -137,27 +139,8 @@ void loop() {
     publishStatus();
   }
 
-  IHCRS485Packet *packet = ihc.receive();
-  if (packet != NULL) {
-    switch (packet->getDataType()) {
-      case IHCDefs::OUTP_STATE:
-        {
-          unsigned long changeId = updateStates(packet->getData());
-          if (changeId > 0) {
-            for (int i = 0; i < SIZE; i++) {
-              IHCIO io = ios[i];
-              if (io.getChangeId() == changeId) {
-                publishData(io);
-              }
-            }
-          }
-        }
-        break;
-
-      default:
-        ;
-    }
-  }
+  publishChanges(true, outputDirty);
+  publishChanges(false, inputDirty);
 }
 
 void setup_wifi() {
@@ -239,16 +222,54 @@ boolean publishPayload(JsonObject& root) {
   return ret;
 }
 
-boolean publishData(IHCIO & io) {
+// a port stays dirty until it is published
+void publishChanges(bool isOutput, byte *pDirty) {
+  for (unsigned short mi = 0; mi < MAX_MODULES; mi++) {
+    byte dirty = pDirty[mi];
+    for (unsigned short pi = 0; dirty != 0; pi++, dirty >>= 1) {
+      if ((dirty & 0x1) && publishPort(mi + 1, pi + 1, isOutput)) {
+        pDirty[mi] &= ~(0x1 << pi);
+      }
+    }
+  }
+}
+
+// ports that are not in IHCConfig.h are skipped
+boolean publishPort(unsigned short module, unsigned short port, bool isOutput) {
+  char name[NAME_SIZE];
+  if (!findName(module, port, isOutput, name)) {
+    return true;
+  }
+
+  StaticJsonBuffer<OUTPUT_BUFFER_LENGTH> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonObject& d = root.createNestedObject("d");
+
+  d["module"] = module;
+  d["port"] = port;
+  d["name"] = (const char*)name;
+  d["type"] = isOutput ? "output" : "input";
+  d["state"] = isOutput ? ihc.getOutput(module, port) : ihc.getInput(module, port);
+
+  return publishPayload(root);
+}
+
+// IHC reports every port it sees change on the bus, and all ports of
+// its first snapshot, the named ones are published from loop()
+void ioChanged(bool isOutput, byte module, byte port, bool state) {
+  markDirty(module, port, isOutput);
+}
+
+void sceneDone(bool success) {
+  publishScene(success);
+}
+
+boolean publishScene(bool success) {
   StaticJsonBuffer<OUTPUT_BUFFER_LENGTH> jsonBuffer;
   JsonObject& root = jsonBuffer.createObject();
   JsonObject& d = root.createNestedObject("d");
 
-  d["module"] = io.getModule();
-  d["port"] = io.getPort();
-  d["name"] = io.getName();
-  d["type"] = io.isOutput() ? "output" : "input";
-  d["state"] = io.getState();
+  d["scene"] = success ? "done" : "failed";
 
   return publishPayload(root);
 }
@@ -261,6 +282,13 @@ boolean publishStatus() {
   JsonObject& d = root.createNestedObject("d");
 
   d["status"] = status;
+  d["queue"] = ihc.getQueueDepth();
+  d["dropped"] = ihc.getDropped();
+  d["parsed"] = ihc.getBytesParsed();
+  d["discarded"] = ihc.getBytesDiscarded();
+  d["interval"] = ihc.getPollingInterval();
+  d["latency"] = ihc.getChangeLatency();
+  d["maxLatency"] = ihc.getMaxChangeLatency();
 
   return publishPayload(root);
 }
@@ -300,15 +328,29 @@ void handleUpdate(byte * payload) {
       // Publish data
       for (int i = 0; i < SIZE; i++)
       {
-        publishData(ios[i]);
+        publishPort(pgm_read_byte(&names[i].module), pgm_read_byte(&names[i].port), pgm_read_byte(&names[i].isOutput));
       }
     } else if (cmd == "change") {
       unsigned short module = d["module"];
       unsigned short port = d["port"];
       bool state = d["state"];
-      Vector<byte> *pData = changeOutput(module, port, state);
-      sendPacket.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, pData);
-      ihc.send(&sendPacket);
+      sendChange(module, port, state);
+    } else if (cmd == "scene") {
+      // "outputs": [[module, port, state], ...]
+      JsonArray& outputs = d["outputs"];
+      IHCOutputState scene[MAX_SCENE_SIZE];
+      unsigned int count = 0;
+      for (unsigned int i = 0; i < outputs.size() && count < MAX_SCENE_SIZE; i++) {
+        JsonArray& output = outputs[i];
+        scene[count].module = output[0];
+        scene[count].port = output[1];
+        scene[count].state = output[2];
+        count++;
+      }
+      if (!ihc.sendScene(scene, count)) {
+        Serial.println("IHC scene not sent");
+        publishScene(false);
+      }
     } else if (cmd == "pulse") {
       pulse_duration = d["duration"];
       pulse_module = d["module"];
@@ -328,9 +370,7 @@ void pulseOn() {
     state = 3;
   }
   
-  Vector<byte> *pData = changeOutput(pulse_module, pulse_port, true);
-  sendPacket.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, pData);
-  ihc.send(&sendPacket);
+  sendChange(pulse_module, pulse_port, true);
   pulse_on = millis();
   Serial.print("Pulse ON, state=");Serial.println(state);
 }
@@ -348,9 +388,16 @@ void pulseOff() {
     }
   }
 
-  Vector<byte> *pData = changeOutput(pulse_module, pulse_port, false);
-  sendPacket.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, pData);
-  ihc.send(&sendPacket);
+  sendChange(pulse_module, pulse_port, false);
   pulse_off = millis();
   Serial.print("Pulse OFF, state=");Serial.println(state);
 }
+
+// IHC queues its own copy of the packet
+void sendChange(unsigned short module, unsigned short port, bool state) {
+  IHCRS485Packet packet;
+  packet.setData(IHCDefs::ID_IHC, IHCDefs::SET_OUTPUT, changeOutput(module, port, state));
+  if (!ihc.send(&packet)) {
+    Serial.println("IHC send queue full");
+  }
+}
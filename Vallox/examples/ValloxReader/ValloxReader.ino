@@ -17,7 +17,7 @@ void loop() {
   vx.loop();
 
   unsigned long newUpdate = vx.getUpdated();
-  if (lastUpdate != newUpdate) {
+  if (vx.isReady() && lastUpdate != newUpdate) {
     // data has changed
     lastUpdate = newUpdate;
     prettyPrint();
@@ -60,6 +60,13 @@ void prettyPrint() {
   Serial.print("Service period (months) = "); Serial.println(vx.getServicePeriod());
   Serial.print("Service count down (months) = "); Serial.println(vx.getServiceCounter());
   Serial.print("Heating target (C) = "); Serial.println(vx.getHeatingTarget());
+  Serial.print("Post heating = "); vx.isPostHeating() ? Serial.println("on") : Serial.println("off");
+  Serial.print("Post heating target (C) = "); Serial.println(vx.getPostHeatingTarget());
+  Serial.print("Max fan speed (1-8) = "); Serial.println(vx.getMaxFanSpeed());
+  Serial.print("CO2 (ppm) = "); Serial.println(vx.getCo2());
+  Serial.print("Fault code = "); Serial.println(vx.getFaultCode());
+  // any variable in the registry can be read with getValue()
+  Serial.print("Preheating target (C) = "); Serial.println(vx.getValue(VX_VARIABLE_PREHEATING_TARGET));
   Serial.println();
 }
 
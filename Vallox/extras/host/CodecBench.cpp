@@ -0,0 +1,133 @@
+// =======================================
+// VALLOX CODEC BENCHMARK
+// =======================================
+// Compares the table conversions in ValloxCodec.cpp to the original
+// linear scan and floating point conversions.
+//
+// build and run in this directory:
+// g++ -O2 -std=c++11 -I. -I../../src ../../src/ValloxCodec.cpp CodecBench.cpp -o codec_bench
+// ./codec_bench
+
+#include <chrono>
+#include <stdio.h>
+#include "ValloxCodec.h"
+
+#define ROUNDS 20000
+
+// original conversions
+
+const int8_t legacyFanSpeeds[] = {
+  VX_FAN_SPEED_1, VX_FAN_SPEED_2, VX_FAN_SPEED_3, VX_FAN_SPEED_4,
+  VX_FAN_SPEED_5, VX_FAN_SPEED_6, VX_FAN_SPEED_7, (int8_t)VX_FAN_SPEED_8
+};
+
+int8_t legacyTemps[256];
+
+byte legacyCel2Ntc(int cel) {
+  for (int i = 0; i < 256; i++) {
+    if (legacyTemps[i] == cel) {
+      return i;
+    }
+  }
+
+  return 0x83;
+}
+
+int legacyHex2FanSpeed(byte hex) {
+  for (unsigned int i = 0; i < sizeof(legacyFanSpeeds); i++) {
+    if (legacyFanSpeeds[i] == hex) {
+      return i + 1;
+    }
+  }
+
+  return NOT_SET;
+}
+
+int legacyHex2Rh(byte hex) {
+  if (hex >= 51) {
+    return (hex - 51) / 2.04;
+  } else {
+    return NOT_SET;
+  }
+}
+
+// timing
+
+volatile int sink;
+
+template <typename F>
+double nsPerCall(F f, int inputs) {
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int i = 0; i < inputs; i++) {
+      sink = f(i);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count() / ((double)ROUNDS * inputs);
+}
+
+void report(const char* name, double legacy, double table, int mismatches) {
+  printf("%-14s legacy %7.2f ns  table %7.2f ns  speedup %6.1fx  mismatches %d\n",
+         name, legacy, table, legacy / table, mismatches);
+}
+
+int main() {
+  for (int i = 0; i < 256; i++) {
+    legacyTemps[i] = vxNtc2Cel(i);
+  }
+
+  int cels = VX_NTC_MAX_CEL - VX_NTC_MIN_CEL + 1;
+  int mismatches = 0;
+  for (int cel = VX_NTC_MIN_CEL; cel <= VX_NTC_MAX_CEL; cel++) {
+    // the table picks the middle of a run, both must read back the same
+    byte legacy = legacyCel2Ntc(cel);
+    if (legacy != 0x83 && vxNtc2Cel(legacy) != vxNtc2Cel(vxCel2Ntc(cel))) {
+      mismatches++;
+    }
+  }
+  report("cel2Ntc",
+         nsPerCall([](int i) { return (int)legacyCel2Ntc(i + VX_NTC_MIN_CEL); }, cels),
+         nsPerCall([](int i) { return (int)vxCel2Ntc(i + VX_NTC_MIN_CEL); }, cels),
+         mismatches);
+
+  mismatches = 0;
+  for (int hex = 0; hex < 256; hex++) {
+    if (legacyHex2FanSpeed(hex) != vxHex2FanSpeed(hex)) {
+      mismatches++;
+    }
+  }
+  report("hex2FanSpeed",
+         nsPerCall([](int i) { return legacyHex2FanSpeed(i); }, 256),
+         nsPerCall([](int i) { return vxHex2FanSpeed(i); }, 256),
+         mismatches);
+
+  mismatches = 0;
+  for (int hex = 0; hex < 256; hex++) {
+    if (legacyHex2Rh(hex) != vxHex2Rh(hex)) {
+      mismatches++;
+    }
+  }
+  report("hex2Rh",
+         nsPerCall([](int i) { return legacyHex2Rh(i); }, 256),
+         nsPerCall([](int i) { return vxHex2Rh(i); }, 256),
+         mismatches);
+
+  // tenths must stay within half a degree of the integer table
+  mismatches = 0;
+  for (int ntc = 0; ntc < 256; ntc++) {
+    int diff = vxNtc2CelTenths(ntc) - vxNtc2Cel(ntc) * 10;
+    if (diff < -5 || diff > 5) {
+      mismatches++;
+    }
+  }
+  printf("ntc2CelTenths  %7.2f ns  off by more than 0.5 C: %d\n",
+         nsPerCall([](int i) { return vxNtc2CelTenths(i); }, 256), mismatches);
+
+  // the original table lost fan speed 8 to a signed compare
+  printf("note: legacy hex2FanSpeed(0xFF) = %d, table = %d\n",
+         legacyHex2FanSpeed(0xFF), vxHex2FanSpeed(0xFF));
+
+  return 0;
+}
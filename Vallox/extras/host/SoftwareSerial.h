@@ -0,0 +1,37 @@
+// =======================================
+// MOCK SOFTWARESERIAL FOR HOST BUILDS
+// =======================================
+// all instances share one simulated bus
+// the host program injects the bytes other devices send
+
+#ifndef HOST_SOFTWARESERIAL_H
+#define HOST_SOFTWARESERIAL_H
+
+#include <Arduino.h>
+
+#define HOST_BUS_SIZE 4096
+
+class SoftwareSerial : public Stream {
+  public:
+    SoftwareSerial(byte rx, byte tx) {}
+    void begin(long speed) {}
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t b);
+
+    // host side of the bus
+    // returns false if the receive buffer overflowed
+    static boolean inject(const byte* data, size_t length);
+    static unsigned long getWritten();
+    static void reset();
+
+  private:
+    static byte bus[HOST_BUS_SIZE];
+    static size_t head;
+    static size_t count;
+    static unsigned long written;
+};
+
+#endif
@@ -0,0 +1,353 @@
+// =======================================
+// VALLOX BUS REPLAY
+// =======================================
+// Replays a bus capture through Vallox on the host and reports the
+// decode rate, decode latency and whether the cache followed the bus.
+//
+// build in this directory:
+// g++ -O2 -std=c++11 -I. -I../../src ../../src/*.cpp HostArduino.cpp ValloxReplay.cpp -o vallox_replay
+//
+// usage: vallox_replay [-n noise%] [-t truncate%] [-r rounds] [-s seed] capture
+//        vallox_replay -g messages > capture
+//
+// A capture is a text file with one received chunk per line, as hex
+// bytes separated by spaces. Lines starting with # are comments. Lines
+// of six bytes with a valid checksum are messages, anything else is
+// replayed as recorded noise.
+//
+// captures/synthetic.txt is made with -g, it is not a recording of a
+// real bus. Expected values come from the conversions of the original
+// library copied below, so a codec regression shows up as a mismatch.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "Vallox.h"
+
+#define MAX_LINE_BYTES 64
+
+struct Chunk {
+  std::vector<byte> bytes;
+  boolean isMessage;
+};
+
+// reference decoding, independent of Vallox.cpp and ValloxCodec.cpp:
+// the table, loop, switch and float conversions of the original library
+
+const int8_t refTemps[256] = {
+  -74, -70, -66, -62, -59, -56, -54, -52, -50, -48, // 0x00 - 0x09
+  -47, -46, -44, -43, -42, -41, -40, -39, -38, -37, // 0x0a - 0x13
+  -36, -35, -34, -33, -33, -32, -31, -30, -30, -29, // 0x14 - 0x1d
+  -28, -28, -27, -27, -26, -25, -25, -24, -24, -23, // 0x1e - 0x27
+  -23, -22, -22, -21, -21, -20, -20, -19, -19, -19, // 0x28 - 0x31
+  -18, -18, -17, -17, -16, -16, -16, -15, -15, -14, // 0x32 - 0x3b
+  -14, -14, -13, -13, -12, -12, -12, -11, -11, -11, // 0x3c - 0x45
+  -10, -10, -9, -9, -9, -8, -8, -8, -7, -7,         // 0x46 - 0x4f
+  -7, -6, -6, -6, -5, -5, -5, -4, -4, -4,           // 0x50 - 0x59
+  -3, -3, -3, -2, -2, -2, -1, -1, -1, -1,           // 0x5a - 0x63
+  0,  0,  0,  1,  1,  1,  2,  2,  2,  3,            // 0x64 - 0x6d
+  3,  3,  4,  4,  4,  5,  5,  5,  5,  6,            // 0x6e - 0x77
+  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,            // 0x78 - 0x81
+  9, 10, 10, 10, 11, 11, 11, 12, 12, 12,            // 0x82 - 0x8b
+  13, 13, 13, 14, 14, 14, 15, 15, 15, 16,           // 0x8c - 0x95
+  16, 16, 17, 17, 18, 18, 18, 19, 19, 19,           // 0x96 - 0x9f
+  20, 20, 21, 21, 21, 22, 22, 22, 23, 23,           // 0xa0 - 0xa9
+  24, 24, 24, 25, 25, 26, 26, 27, 27, 27,           // 0xaa - 0xb3
+  28, 28, 29, 29, 30, 30, 31, 31, 32, 32,           // 0xb4 - 0xbd
+  33, 33, 34, 34, 35, 35, 36, 36, 37, 37,           // 0xbe - 0xc7
+  38, 38, 39, 40, 40, 41, 41, 42, 43, 43,           // 0xc8 - 0xd1
+  44, 45, 45, 46, 47, 48, 48, 49, 50, 51,           // 0xd2 - 0xdb
+  52, 53, 53, 54, 55, 56, 57, 59, 60, 61,           // 0xdc - 0xe5
+  62, 63, 65, 66, 68, 69, 71, 73, 75, 77,           // 0xe6 - 0xef
+  79, 81, 82, 86, 90, 93, 97, 100, 100, 100,        // 0xf0 - 0xf9
+  100, 100, 100, 100, 100, 100                      // 0xfa - 0xff
+};
+
+int refHex2FanSpeed(byte hex) {
+  const byte speeds[] = { 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF };
+  for (unsigned int i = 0; i < sizeof(speeds); i++) {
+    if (speeds[i] == hex) {
+      return i + 1;
+    }
+  }
+
+  return NOT_SET;
+}
+
+int refHex2Rh(byte hex) {
+  if (hex >= 51) {
+    return (hex - 51) / 2.04;
+  } else {
+    return NOT_SET;
+  }
+}
+
+int refHex2HtCel(byte hex) {
+  switch (hex) {
+    case 0x01: return 10;
+    case 0x03: return 13;
+    case 0x07: return 15;
+    case 0x0F: return 18;
+    case 0x1F: return 20;
+    case 0x3F: return 23;
+    case 0x7F: return 25;
+    case 0xFF: return 27;
+    default: return NOT_SET;
+  }
+}
+
+// returns false if Vallox is not expected to cache the variable
+boolean expectedValue(byte variable, byte value, int* expected) {
+  switch (variable) {
+    case VX_VARIABLE_T_OUTSIDE:
+    case VX_VARIABLE_T_INSIDE:
+    case VX_VARIABLE_T_INCOMING:
+    case VX_VARIABLE_T_EXHAUST:
+    case VX_VARIABLE_POST_HEATING_TARGET:
+      *expected = refTemps[value];
+      return true;
+    case VX_VARIABLE_FAN_SPEED:
+    case VX_VARIABLE_DEFAULT_FAN_SPEED:
+    case VX_VARIABLE_MAX_FAN_SPEED:
+      *expected = refHex2FanSpeed(value);
+      return true;
+    case VX_VARIABLE_RH:
+      *expected = refHex2Rh(value);
+      return true;
+    case VX_VARIABLE_HEATING_TARGET:
+      *expected = refHex2HtCel(value);
+      return true;
+    case VX_VARIABLE_STATUS:
+    case VX_VARIABLE_IO_07:
+    case VX_VARIABLE_IO_08:
+    case VX_VARIABLE_CO2_HI:
+    case VX_VARIABLE_CO2_LO:
+    case VX_VARIABLE_FAULT_CODE:
+    case VX_VARIABLE_SERVICE_PERIOD:
+    case VX_VARIABLE_SERVICE_COUNTER:
+      *expected = value;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// same addressing rule as Vallox::readMessage() with the default devices
+boolean isListened(const byte message[]) {
+  boolean toGroup = message[2] == VX_MSG_PANELS || message[2] == VX_MSG_MAINBOARDS;
+  boolean fromPanel = message[1] > VX_MSG_PANELS && message[1] <= VX_MSG_MAX_ADDRESS;
+  return (message[1] == VX_MSG_MAINBOARD_1 &&
+          (toGroup || message[2] == VX_MSG_PANEL_1 || message[2] == VX_MSG_MAINBOARD_1)) ||
+         (fromPanel && (toGroup || message[2] == VX_MSG_MAINBOARD_1));
+}
+
+boolean isMessage(const std::vector<byte>& bytes) {
+  return bytes.size() == VX_MSG_LENGTH && bytes[0] == VX_MSG_DOMAIN &&
+         bytes[VX_MSG_LENGTH - 1] == Vallox::calculateCheckSum(&bytes[0]);
+}
+
+boolean loadCapture(const char* path, std::vector<Chunk>* chunks) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+
+  char line[MAX_LINE_BYTES * 3 + 2];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#') {
+      continue;
+    }
+
+    Chunk chunk;
+    char* p = line;
+    char* end;
+    unsigned long b = strtoul(p, &end, 16);
+    while (end != p) {
+      chunk.bytes.push_back(b);
+      p = end;
+      b = strtoul(p, &end, 16);
+    }
+
+    if (!chunk.bytes.empty()) {
+      chunk.isMessage = isMessage(chunk.bytes);
+      chunks->push_back(chunk);
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+// synthetic traffic: mainboard broadcasts and panel 1 commands
+void generate(int count) {
+  const byte temps[] = {
+    VX_VARIABLE_T_OUTSIDE, VX_VARIABLE_T_INSIDE, VX_VARIABLE_T_INCOMING, VX_VARIABLE_T_EXHAUST
+  };
+
+  printf("# synthetic Vallox capture, %d messages\n", count);
+  for (int i = 0; i < count; i++) {
+    byte message[VX_MSG_LENGTH];
+    message[0] = VX_MSG_DOMAIN;
+    message[1] = VX_MSG_MAINBOARD_1;
+    message[2] = VX_MSG_PANELS;
+
+    switch (rand() % 8) {
+      case 0:
+        message[1] = VX_MSG_PANEL_1;
+        message[2] = VX_MSG_MAINBOARDS;
+        // fall through
+      case 1:
+        message[3] = VX_VARIABLE_FAN_SPEED;
+        message[4] = vxFanSpeed2Hex(1 + rand() % VX_MAX_FAN_SPEED);
+        break;
+      case 2:
+        message[3] = VX_VARIABLE_STATUS;
+        message[4] = rand();
+        break;
+      case 3:
+        message[3] = VX_VARIABLE_RH;
+        message[4] = 51 + rand() % 205;
+        break;
+      case 4:
+        message[3] = VX_VARIABLE_CO2_LO;
+        message[4] = rand();
+        break;
+      default:
+        message[3] = temps[rand() % 4];
+        message[4] = 0x60 + rand() % 0x60;
+        break;
+    }
+    message[5] = Vallox::calculateCheckSum(message);
+
+    for (int j = 0; j < VX_MSG_LENGTH; j++) {
+      printf(j == 0 ? "%02X" : " %02X", message[j]);
+    }
+    printf("\n");
+  }
+}
+
+// transfer time of the bytes at 9600 baud
+unsigned long transferMillis(size_t bytes) {
+  return (bytes * 10 * 1000 + 9599) / 9600;
+}
+
+int main(int argc, char* argv[]) {
+  int noise = 0;
+  int truncate = 0;
+  int rounds = 1;
+  int generated = 0;
+  unsigned int seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:r:s:g:")) != -1) {
+    switch (opt) {
+      case 'n': noise = atoi(optarg); break;
+      case 't': truncate = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      case 's': seed = atoi(optarg); break;
+      case 'g': generated = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n noise%%] [-t truncate%%] [-r rounds] [-s seed] capture\n"
+                        "       %s -g messages\n", argv[0], argv[0]);
+        return 2;
+    }
+  }
+  srand(seed);
+
+  if (generated > 0) {
+    generate(generated);
+    return 0;
+  }
+
+  std::vector<Chunk> chunks;
+  if (optind >= argc || !loadCapture(argv[optind], &chunks)) {
+    fprintf(stderr, "cannot read capture\n");
+    return 2;
+  }
+
+  Vallox vx(0, 0);
+  vx.init();
+
+  unsigned long messages = 0;
+  unsigned long truncated = 0;
+  unsigned long noiseBytes = 0;
+  unsigned long checked = 0;
+  unsigned long wrong = 0;
+  unsigned long missed = 0;
+  double totalNs = 0;
+  double maxNs = 0;
+
+  for (int round = 0; round < rounds; round++) {
+    for (size_t c = 0; c < chunks.size(); c++) {
+      const Chunk& chunk = chunks[c];
+      std::vector<byte> bytes = chunk.bytes;
+      boolean expected = chunk.isMessage;
+
+      if (noise > 0 && rand() % 100 < noise) {
+        int n = 1 + rand() % 8;
+        for (int i = 0; i < n; i++) {
+          bytes.insert(bytes.begin(), (byte)rand());
+        }
+        noiseBytes += n;
+      }
+
+      if (expected && truncate > 0 && rand() % 100 < truncate) {
+        bytes.resize(1 + rand() % (VX_MSG_LENGTH - 1));
+        expected = false;
+        truncated++;
+      }
+
+      SoftwareSerial::inject(&bytes[0], bytes.size());
+      hostAdvanceMillis(transferMillis(bytes.size()));
+
+      unsigned long accepted = vx.getAcceptedMessages();
+      auto start = std::chrono::steady_clock::now();
+      vx.loop();
+      auto end = std::chrono::steady_clock::now();
+      double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+      if (!expected) {
+        continue;
+      }
+
+      messages++;
+      totalNs += ns;
+      if (ns > maxNs) {
+        maxNs = ns;
+      }
+
+      if (vx.getAcceptedMessages() == accepted) {
+        missed++;
+        continue;
+      }
+
+      int value;
+      if (isListened(&bytes[bytes.size() - VX_MSG_LENGTH]) &&
+          expectedValue(chunk.bytes[3], chunk.bytes[4], &value)) {
+        checked++;
+        if (vx.getValue(chunk.bytes[3]) != value) {
+          wrong++;
+          fprintf(stderr, "cache mismatch for %02X: %d != %d\n",
+                  chunk.bytes[3], vx.getValue(chunk.bytes[3]), value);
+        }
+      }
+    }
+  }
+
+  printf("chunks replayed     %lu\n", (unsigned long)chunks.size() * rounds);
+  printf("messages expected   %lu\n", messages);
+  printf("messages missed     %lu\n", missed);
+  printf("truncated / noise   %lu messages / %lu bytes\n", truncated, noiseBytes);
+  printf("parser accepted     %lu\n", vx.getAcceptedMessages());
+  printf("parser corrupt      %lu\n", vx.getCorruptMessages());
+  printf("parser dropped      %lu bytes\n", vx.getDroppedBytes());
+  printf("cache checks        %lu, wrong %lu\n", checked, wrong);
+  printf("decode latency      %.0f ns mean, %.0f ns max\n",
+         messages > 0 ? totalNs / messages : 0.0, maxNs);
+  printf("decode rate         %.0f messages/s\n", totalNs > 0 ? messages * 1e9 / totalNs : 0.0);
+  printf("poll bytes sent     %lu, polls failed %lu\n", SoftwareSerial::getWritten(), vx.getPollFailures());
+
+  return wrong == 0 && missed == 0 ? 0 : 1;
+}
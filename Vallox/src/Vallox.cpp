@@ -4,57 +4,137 @@
 
 #include "Vallox.h"
 
-// VX fan speed (1-8) conversion table
-const int8_t vxFanSpeeds[] = {
-  VX_FAN_SPEED_1, 
-  VX_FAN_SPEED_2, 
-  VX_FAN_SPEED_3, 
-  VX_FAN_SPEED_4, 
-  VX_FAN_SPEED_5, 
-  VX_FAN_SPEED_6, 
-  VX_FAN_SPEED_7, 
-  VX_FAN_SPEED_8 
+// VX variable registry
+// the position of a variable in the table is its slot in the data cache
+struct VxVariable {
+  byte id;
+  byte codec;
+  byte access;
 };
 
-// VX NTC temperature conversion table
-const int8_t vxTemps[] = {
-  -74, -70, -66, -62, -59, -56, -54, -52, -50, -48, // 0x00 - 0x09
-  -47, -46, -44, -43, -42, -41, -40, -39, -38, -37, // 0x0a - 0x13
-  -36, -35, -34, -33, -33, -32, -31, -30, -30, -29, // 0x14 - 0x1d
-  -28, -28, -27, -27, -26, -25, -25, -24, -24, -23, // 0x1e - 0x27
-  -23, -22, -22, -21, -21, -20, -20, -19, -19, -19, // 0x28 - 0x31
-  -18, -18, -17, -17, -16, -16, -16, -15, -15, -14, // 0x32 - 0x3b
-  -14, -14, -13, -13, -12, -12, -12, -11, -11, -11, // 0x3c - 0x45
-  -10, -10, -9, -9, -9, -8, -8, -8, -7, -7,         // 0x46 - 0x4f
-  -7, -6, -6, -6, -5, -5, -5, -4, -4, -4,           // 0x50 - 0x59
-  -3, -3, -3, -2, -2, -2, -1, -1, -1, -1,           // 0x5a - 0x63
-  0,  0,  0,  1,  1,  1,  2,  2,  2,  3,            // 0x64 - 0x6d
-  3,  3,  4,  4,  4,  5,  5,  5,  5,  6,            // 0x6e - 0x77
-  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,            // 0x78 - 0x81
-  9, 10, 10, 10, 11, 11, 11, 12, 12, 12,            // 0x82 - 0x8b
-  13, 13, 13, 14, 14, 14, 15, 15, 15, 16,           // 0x8c - 0x95
-  16, 16, 17, 17, 18, 18, 18, 19, 19, 19,           // 0x96 - 0x9f
-  20, 20, 21, 21, 21, 22, 22, 22, 23, 23,           // 0xa0 - 0xa9
-  24, 24, 24, 25, 25, 26, 26, 27, 27, 27,           // 0xaa - 0xb3
-  28, 28, 29, 29, 30, 30, 31, 31, 32, 32,           // 0xb4 - 0xbd
-  33, 33, 34, 34, 35, 35, 36, 36, 37, 37,           // 0xbe - 0xc7
-  38, 38, 39, 40, 40, 41, 41, 42, 43, 43,           // 0xc8 - 0xd1
-  44, 45, 45, 46, 47, 48, 48, 49, 50, 51,           // 0xd2 - 0xdb
-  52, 53, 53, 54, 55, 56, 57, 59, 60, 61,           // 0xdc - 0xe5
-  62, 63, 65, 66, 68, 69, 71, 73, 75, 77,           // 0xe6 - 0xef
-  79, 81, 82, 86, 90, 93, 97, 100, 100, 100,        // 0xf0 - 0xf9
-  100, 100, 100, 100, 100, 100                      // 0xfa - 0xff
+#define VX_ACCESS_RW (VX_ACCESS_READ | VX_ACCESS_WRITE)
+#define VX_SLOT_NONE 0xFF
+
+constexpr VxVariable vxVariables[] PROGMEM = {
+  { VX_VARIABLE_IO_06,               VX_CODEC_RAW, VX_ACCESS_READ },
+  { VX_VARIABLE_IO_07,               VX_CODEC_RAW, VX_ACCESS_READ | VX_ACCESS_INIT | VX_ACCESS_POLL },
+  { VX_VARIABLE_IO_08,               VX_CODEC_RAW, VX_ACCESS_READ | VX_ACCESS_INIT | VX_ACCESS_POLL },
+  { VX_VARIABLE_FAN_SPEED,           VX_CODEC_FAN, VX_ACCESS_RW | VX_ACCESS_INIT },
+  { VX_VARIABLE_CO2_HI,              VX_CODEC_RAW, VX_ACCESS_READ | VX_ACCESS_INIT | VX_ACCESS_POLL },
+  { VX_VARIABLE_CO2_LO,              VX_CODEC_RAW, VX_ACCESS_READ | VX_ACCESS_INIT | VX_ACCESS_POLL },
+  { VX_VARIABLE_FAULT_CODE,          VX_CODEC_RAW, VX_ACCESS_READ | VX_ACCESS_INIT | VX_ACCESS_POLL },
+  { VX_VARIABLE_RH,                  VX_CODEC_RH,  VX_ACCESS_READ | VX_ACCESS_INIT },
+  { VX_VARIABLE_POST_HEATING_ON,     VX_CODEC_RAW, VX_ACCESS_READ },
+  { VX_VARIABLE_POST_HEATING_OFF,    VX_CODEC_RAW, VX_ACCESS_READ },
+  { VX_VARIABLE_POST_HEATING_TARGET, VX_CODEC_NTC, VX_ACCESS_READ | VX_ACCESS_INIT },
+  { VX_VARIABLE_T_OUTSIDE,           VX_CODEC_NTC, VX_ACCESS_READ | VX_ACCESS_INIT },
+  { VX_VARIABLE_T_INSIDE,            VX_CODEC_NTC, VX_ACCESS_READ | VX_ACCESS_INIT },
+  { VX_VARIABLE_T_INCOMING,          VX_CODEC_NTC, VX_ACCESS_READ | VX_ACCESS_INIT },
+  { VX_VARIABLE_T_EXHAUST,           VX_CODEC_NTC, VX_ACCESS_READ | VX_ACCESS_INIT },
+  { VX_VARIABLE_STATUS,              VX_CODEC_RAW, VX_ACCESS_RW | VX_ACCESS_INIT },
+  { VX_VARIABLE_HEATING_TARGET,      VX_CODEC_HT,  VX_ACCESS_RW | VX_ACCESS_INIT },
+  { VX_VARIABLE_MAX_FAN_SPEED,       VX_CODEC_FAN, VX_ACCESS_RW | VX_ACCESS_INIT },
+  { VX_VARIABLE_SERVICE_PERIOD,      VX_CODEC_RAW, VX_ACCESS_RW | VX_ACCESS_INIT },
+  { VX_VARIABLE_PREHEATING_TARGET,   VX_CODEC_NTC, VX_ACCESS_RW },
+  { VX_VARIABLE_INPUT_FAN_STOP,      VX_CODEC_NTC, VX_ACCESS_RW },
+  { VX_VARIABLE_DEFAULT_FAN_SPEED,   VX_CODEC_FAN, VX_ACCESS_RW | VX_ACCESS_INIT },
+  { VX_VARIABLE_PROGRAM,             VX_CODEC_RAW, VX_ACCESS_RW },
+  { VX_VARIABLE_SERVICE_COUNTER,     VX_CODEC_RAW, VX_ACCESS_RW | VX_ACCESS_INIT | VX_ACCESS_POLL },
+  { VX_VARIABLE_BASIC_RH,            VX_CODEC_RH,  VX_ACCESS_RW },
+  { VX_VARIABLE_BYPASS_TEMP,         VX_CODEC_NTC, VX_ACCESS_RW },
+  { VX_VARIABLE_CO2_SET_POINT_HI,    VX_CODEC_RAW, VX_ACCESS_RW },
+  { VX_VARIABLE_CO2_SET_POINT_LO,    VX_CODEC_RAW, VX_ACCESS_RW }
+};
+
+static_assert(sizeof(vxVariables) / sizeof(vxVariables[0]) == VX_VARIABLE_COUNT,
+              "VX_VARIABLE_COUNT does not match the registry");
+static_assert(VX_VARIABLE_COUNT <= 32, "change bitmap has room for 32 slots");
+
+// registry slot of a variable, resolved at compile time
+constexpr byte vxSlotOf(byte variable, byte slot) {
+  return slot >= VX_VARIABLE_COUNT ? VX_SLOT_NONE :
+         vxVariables[slot].id == variable ? slot : vxSlotOf(variable, slot + 1);
+}
+
+template <byte variable> struct VxSlot {
+  enum : byte { value = vxSlotOf(variable, 0) };
+};
+
+#define VX_SLOT(variable) (VxSlot<variable>::value)
+
+// number of variables polled by init(), resolved at compile time
+constexpr int vxInitCount(byte slot) {
+  return slot >= VX_VARIABLE_COUNT ? 0 :
+         ((vxVariables[slot].access & VX_ACCESS_INIT) ? 1 : 0) + vxInitCount(slot + 1);
+}
+
+// init() queues the polls of all mainboards at once, none may be dropped
+static_assert(VX_POLL_QUEUE_SIZE >= vxInitCount(0) * VX_MAX_MAINBOARDS,
+              "VX_POLL_QUEUE_SIZE has no room for the init polls");
+
+// VX variable id to registry slot dispatch table
+#define VX_SLOTS_4(n) vxSlotOf(n, 0), vxSlotOf(n + 1, 0), vxSlotOf(n + 2, 0), vxSlotOf(n + 3, 0)
+#define VX_SLOTS_16(n) VX_SLOTS_4(n), VX_SLOTS_4(n + 4), VX_SLOTS_4(n + 8), VX_SLOTS_4(n + 12)
+#define VX_SLOTS_64(n) VX_SLOTS_16(n), VX_SLOTS_16(n + 16), VX_SLOTS_16(n + 32), VX_SLOTS_16(n + 48)
+
+const byte vxSlots[256] PROGMEM = {
+  VX_SLOTS_64(0x00), VX_SLOTS_64(0x40), VX_SLOTS_64(0x80), VX_SLOTS_64(0xC0)
 };
 
 // public
 
-Vallox::Vallox(byte rx, byte tx) {
-  Vallox(rx, tx, false);
+Vallox::Vallox(byte rx, byte tx) : Vallox(rx, tx, false) {
 }
 
 Vallox::Vallox(byte rx, byte tx, boolean debug) {
   serial = new SoftwareSerial(rx, tx);
   isDebug = debug;
+  devices[0].address = VX_MSG_MAINBOARD_1;
+}
+
+boolean Vallox::addMainboard(byte address) {
+  if (address <= VX_MSG_MAINBOARDS || address > VX_MSG_MAX_MAINBOARD ||
+      findMainboard(address) >= 0 || deviceCount >= VX_MAX_MAINBOARDS) {
+    return false;
+  }
+
+  devices[deviceCount++].address = address;
+  return true;
+}
+
+boolean Vallox::setPanelAddress(byte address) {
+  if (address <= VX_MSG_PANELS || address > VX_MSG_MAX_ADDRESS) {
+    return false;
+  }
+
+  panel = address;
+  return true;
+}
+
+byte Vallox::getPanelAddress() {
+  return panel;
+}
+
+byte Vallox::getMainboardCount() {
+  return deviceCount;
+}
+
+byte Vallox::getMainboardAddress(byte index) {
+  return index < deviceCount ? devices[index].address : 0x00;
+}
+
+boolean Vallox::selectMainboard(byte address) {
+  int device = findMainboard(address);
+  if (device < 0) {
+    return false;
+  }
+
+  selected = device;
+  return true;
+}
+
+byte Vallox::getSelectedMainboard() {
+  return devices[selected].address;
 }
 
 void Vallox::init() {
@@ -65,358 +145,734 @@ void Vallox::init() {
   // set the data rate for the SoftwareSerial port
   serial->begin(9600);
 
-  // init cache
-  data.is_on = pollIsOn();
-  data.is_rh_mode = pollIsRhMode();
-  data.is_heating_mode = pollIsHeatingMode();
-  data.is_summer_mode = pollIsSummerMode();
-  data.is_filter = pollIsFilter();
-  data.is_heating = pollIsHeating();
-  data.is_fault = pollIsFault();
-  data.is_service = pollIsService();
-  data.fan_speed =  pollFanSpeed();
-  data.default_fan_speed =  pollDefaultFanSpeed();
-  data.rh = pollRh();
-  data.service_period = pollServicePeriod();
-  data.service_counter = pollServiceCounter();
-  data.heating_target = pollHeatingTarget();
-  data.t_outside = pollOutsideTemp();
-  data.t_inside = pollInsideTemp();
-  data.t_exhaust = pollExhaustTemp();
-  data.t_incoming = pollIncomingTemp();
-
+  // init caches and queue the initial polls of every mainboard
+  // loop() fills the caches as the replies arrive
+  ready = false;
   unsigned long now = millis();
-  data.updated = millis();
-  lastPolled = now;
+  for (int device = 0; device < deviceCount; device++) {
+    VxDevice* d = &devices[device];
+    for (int slot = 0; slot < VX_VARIABLE_COUNT; slot++) {
+      byte access = pgm_read_byte(&vxVariables[slot].access);
+      d->values[slot] = NOT_SET;
+      d->received[slot] = 0;
+      d->schedule[slot].interval = access & VX_ACCESS_POLL ? VX_POLL_MIN_INTERVAL : 0;
+      d->schedule[slot].polled = now;
+
+      if (access & VX_ACCESS_INIT) {
+        queuePoll(device, pgm_read_byte(&vxVariables[slot].id));
+      }
+    }
+
+    d->updated = now;
+    d->changed = 0;
+    d->changedStatusFlags = 0x00;
+    d->statusSet = 0x00;
+    d->statusClear = 0x00;
+    d->statusPolled = false;
+  }
+
+  memset(traffic, 0, sizeof(traffic));
+  lastReceived = now;
 }
 
 void Vallox::loop() {
   byte message[VX_MSG_LENGTH];
 
+  if (serial->available() > 0) {
+    lastReceived = millis();
+  }
+
   // read and decode as long as messages are available
   while (readMessage(message)) {
-    decodeMessage(message);
+    handleMessage(message);
   }
 
-  // poll data that can change without notice  
-  unsigned long now = millis();
-  if(now - lastPolled > POLL_INTERVAL) {
-    lastPolled = now;
-    checkChange(&(data.is_summer_mode), pollIsSummerMode());
-    checkChange(&(data.service_counter), pollServiceCounter());
-  }	  
+  for (int device = 0; device < deviceCount; device++) {
+    processStatus(device);
+  }
+  processWrites();
+  processSchedule();
+  processPolls();
+
+  if (!ready && pollQueueCount == 0 && inFlightCount == 0) {
+    ready = true;
+    for (int device = 0; device < deviceCount; device++) {
+      devices[device].updated = millis();
+    }
+
+    if (isDebug) {
+      Serial.println("Vallox ready");
+    }
+  }
+}
+
+boolean Vallox::isReady() {
+  return ready;
+}
+
+unsigned long Vallox::getPollFailures() {
+  return pollFailures;
+}
+
+unsigned long Vallox::getPollInterval(byte variable) {
+  byte slot = pgm_read_byte(&vxSlots[variable]);
+  return slot == VX_SLOT_NONE ? 0 : devices[selected].schedule[slot].interval;
+}
+
+unsigned long Vallox::getAcceptedMessages() {
+  return parser.getAccepted();
+}
+
+unsigned long Vallox::getCorruptMessages() {
+  return parser.getCorrupt();
+}
+
+unsigned long Vallox::getDroppedBytes() {
+  return parser.getDropped();
+}
+
+unsigned long Vallox::getMessagesFrom(byte address) {
+  if (address < VX_MSG_MIN_ADDRESS || address > VX_MSG_MAX_ADDRESS) {
+    return 0;
+  }
+
+  return traffic[address - VX_MSG_MIN_ADDRESS].from;
+}
+
+unsigned long Vallox::getMessagesTo(byte address) {
+  if (address < VX_MSG_MIN_ADDRESS || address > VX_MSG_MAX_ADDRESS) {
+    return 0;
+  }
+
+  return traffic[address - VX_MSG_MIN_ADDRESS].to;
+}
+
+unsigned long Vallox::getLastSeen(byte address) {
+  if (address < VX_MSG_MIN_ADDRESS || address > VX_MSG_MAX_ADDRESS) {
+    return 0;
+  }
+
+  return traffic[address - VX_MSG_MIN_ADDRESS].seen;
+}
+
+boolean Vallox::requestPoll(byte variable) {
+  return queuePoll(selected, variable);
 }
 
 // setters
 // these will set data both in the bus and cache
 
+boolean Vallox::setValue(byte variable, int value) {
+  byte slot = pgm_read_byte(&vxSlots[variable]);
+  if (slot == VX_SLOT_NONE || !(pgm_read_byte(&vxVariables[slot].access) & VX_ACCESS_WRITE)) {
+    return false;
+  }
+
+  byte codec = pgm_read_byte(&vxVariables[slot].codec);
+  byte hex;
+  if (!encodeValue(codec, value, &hex)) {
+    return false;
+  }
+
+  VxDevice* d = &devices[selected];
+  setVariable(selected, variable, hex);
+  d->raw[slot] = hex;
+  d->received[slot] = millis();
+  checkChange(selected, slot, decodeValue(codec, hex));
+
+  return true;
+}
+
 void Vallox::setFanSpeed(int speed) {
   if (speed <= VX_MAX_FAN_SPEED) {
-    setVariable(VX_VARIABLE_FAN_SPEED, fanSpeed2Hex(speed));
-	data.fan_speed = speed;
+    setValue(VX_VARIABLE_FAN_SPEED, speed);
   }
 }
 
 void Vallox::setDefaultFanSpeed(int speed) {
   if (speed < VX_MAX_FAN_SPEED) {
-    setVariable(VX_VARIABLE_DEFAULT_FAN_SPEED, fanSpeed2Hex(speed));
-	data.default_fan_speed = speed;
+    setValue(VX_VARIABLE_DEFAULT_FAN_SPEED, speed);
   }
 }
 
 void Vallox::setOn() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  setVariable(VX_VARIABLE_STATUS, status | VX_STATUS_FLAG_POWER);
-  data.is_on = true;
+  setStatusFlag(VX_STATUS_FLAG_POWER, true);
 }
 
 void Vallox::setOff() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  setVariable(VX_VARIABLE_STATUS, status & ~VX_STATUS_FLAG_POWER);
-  data.is_on = false;
+  setStatusFlag(VX_STATUS_FLAG_POWER, false);
 }
 
 void Vallox::setRhModeOn() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  setVariable(VX_VARIABLE_STATUS, status | VX_STATUS_FLAG_RH);
-  data.is_rh_mode = true;
+  setStatusFlag(VX_STATUS_FLAG_RH, true);
 }
 
 void Vallox::setRhModeOff() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  setVariable(VX_VARIABLE_STATUS, status & ~VX_STATUS_FLAG_RH);
-  data.is_rh_mode = false;
+  setStatusFlag(VX_STATUS_FLAG_RH, false);
 }
 
 void Vallox::setHeatingModeOn() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  setVariable(VX_VARIABLE_STATUS, status | VX_STATUS_FLAG_HEATING_MODE);
-  data.is_heating_mode = true;
+  setStatusFlag(VX_STATUS_FLAG_HEATING_MODE, true);
 }
 
 void Vallox::setHeatingModeOff() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  setVariable(VX_VARIABLE_STATUS, status & ~VX_STATUS_FLAG_HEATING_MODE);
-  data.is_heating_mode = false;
+  setStatusFlag(VX_STATUS_FLAG_HEATING_MODE, false);
 }
 
 void Vallox::setServicePeriod(int months) {
-  if (months >= 0 && months < 256) {
-    setVariable(VX_VARIABLE_SERVICE_PERIOD, months);
-    data.service_period = months;
-  }
+  setValue(VX_VARIABLE_SERVICE_PERIOD, months);
 }
 
 void Vallox::setServiceCounter(int months) {
-  if (months >= 0 && months < 256) {
-    setVariable(VX_VARIABLE_SERVICE_COUNTER, months);
-    data.service_counter = months;
-  }
+  setValue(VX_VARIABLE_SERVICE_COUNTER, months);
+}
+
+void Vallox::setStatusFlags(byte set, byte clear) {
+  set &= VX_STATUS_FLAGS_WRITABLE;
+  clear &= VX_STATUS_FLAGS_WRITABLE & ~set;
+
+  // later changes override earlier ones
+  VxDevice* d = &devices[selected];
+  d->statusSet = (d->statusSet & ~clear) | set;
+  d->statusClear = (d->statusClear & ~set) | clear;
+}
+
+void Vallox::setStatusMaxAge(unsigned long maxAge) {
+  statusMaxAge = maxAge;
 }
 
 void Vallox::setHeatingTarget(int cel) {
-  if (cel >= 10 && cel <= 27) {
-    byte hex = htCel2Hex(cel);
-    setVariable(VX_VARIABLE_HEATING_TARGET, hex);
-    data.heating_target = cel;
+  if (cel >= VX_MIN_HEATING_TARGET && cel <= VX_MAX_HEATING_TARGET) {
+    setValue(VX_VARIABLE_HEATING_TARGET, cel);
   }
 }
 
+// change tracking
+
+void Vallox::setChangeCallback(VxChangeCallback callback) {
+  changeCallback = callback;
+}
+
+boolean Vallox::hasChanges() {
+  return devices[selected].changed != 0;
+}
+
+boolean Vallox::isChanged(byte variable) {
+  byte slot = pgm_read_byte(&vxSlots[variable]);
+  return slot != VX_SLOT_NONE && (devices[selected].changed & (1UL << slot)) != 0;
+}
+
+byte Vallox::getChangedStatusFlags() {
+  return devices[selected].changedStatusFlags;
+}
+
+void Vallox::clearChanged() {
+  devices[selected].changed = 0;
+  devices[selected].changedStatusFlags = 0x00;
+}
+
 // getters get data from the cache
 
 unsigned long Vallox::getUpdated() {
-  return data.updated;
+  return devices[selected].updated;
+}
+
+int Vallox::getValue(byte variable) {
+  byte slot = pgm_read_byte(&vxSlots[variable]);
+  if (slot == VX_SLOT_NONE) {
+    return NOT_SET;
+  }
+
+  return devices[selected].values[slot];
+}
+
+// finer than getValue(), interpolated from the NTC table
+int Vallox::getTempTenths(byte variable) {
+  byte slot = pgm_read_byte(&vxSlots[variable]);
+  if (slot == VX_SLOT_NONE || pgm_read_byte(&vxVariables[slot].codec) != VX_CODEC_NTC ||
+      !vxIsSet(devices[selected].values[slot])) {
+    return NOT_SET;
+  }
+
+  return vxNtc2CelTenths(devices[selected].raw[slot]);
 }
 
 int Vallox::getInsideTemp() {
-  return data.t_inside;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_T_INSIDE)];
 }
 
 int Vallox::getOutsideTemp() {
-  return data.t_outside;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_T_OUTSIDE)];
 }
 
 int Vallox::getIncomingTemp() {
-  return data.t_incoming;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_T_INCOMING)];
 }
 
 int Vallox::getExhaustTemp() {
-  return data.t_exhaust;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_T_EXHAUST)];
 }
 
 boolean Vallox::isOn() {
-  return data.is_on;
+  return isStatusFlag(VX_STATUS_FLAG_POWER);
 }
 
 boolean Vallox::isRhMode() {
-  return data.is_rh_mode;
+  return isStatusFlag(VX_STATUS_FLAG_RH);
 }
 
 boolean Vallox::isHeatingMode() {
-  return data.is_heating_mode;
+  return isStatusFlag(VX_STATUS_FLAG_HEATING_MODE);
 }
 
 boolean Vallox::isSummerMode() {
-  return data.is_summer_mode;
+  int io = devices[selected].values[VX_SLOT(VX_VARIABLE_IO_08)];
+  return vxIsSet(io) && (io & VX_IO_08_FLAG_SUMMER_MODE) != 0x00;
 }
 
 boolean Vallox::isFilter() {
-  return data.is_filter;
+  return isStatusFlag(VX_STATUS_FLAG_FILTER);
 }
 
 boolean Vallox::isHeating() {
-  return data.is_heating;
+  return isStatusFlag(VX_STATUS_FLAG_HEATING);
 }
 
 boolean Vallox::isFault() {
-  return data.is_fault;
+  return isStatusFlag(VX_STATUS_FLAG_FAULT);
 }
 
 boolean Vallox::isServiceNeeded() {
-  return data.is_service;
+  return isStatusFlag(VX_STATUS_FLAG_SERVICE);
+}
+
+boolean Vallox::isPostHeating() {
+  int io = devices[selected].values[VX_SLOT(VX_VARIABLE_IO_07)];
+  return vxIsSet(io) && (io & VX_IO_07_FLAG_POST_HEATING) != 0x00;
 }
 
 int Vallox::getServicePeriod() {
-  return data.service_period;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_SERVICE_PERIOD)];
 }
 
 int Vallox::getServiceCounter() {
-  return data.service_counter;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_SERVICE_COUNTER)];
 }
 
 int Vallox::getFanSpeed() {
-  return data.fan_speed;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_FAN_SPEED)];
 }
 
 int Vallox::getDefaultFanSpeed() {
-  return data.default_fan_speed;
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_DEFAULT_FAN_SPEED)];
 }
 
-int Vallox::getRh() {
-  return data.rh;
+int Vallox::getMaxFanSpeed() {
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_MAX_FAN_SPEED)];
 }
 
-int Vallox::getHeatingTarget() {
-  return data.heating_target;
+int Vallox::getRh() {
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_RH)];
 }
 
-// private
-
-// pollers poll data from the bus
+// CO2 concentration in ppm, sent in two bytes
+int Vallox::getCo2() {
+  int hi = devices[selected].values[VX_SLOT(VX_VARIABLE_CO2_HI)];
+  int lo = devices[selected].values[VX_SLOT(VX_VARIABLE_CO2_LO)];
+  if (!vxIsSet(hi) || !vxIsSet(lo)) {
+    return NOT_SET;
+  }
 
-int Vallox::pollInsideTemp() {
-  byte ntc = pollVariable(VX_VARIABLE_T_INSIDE);
-  return ntc2Cel(ntc);
+  return (hi << 8) | lo;
 }
 
-int Vallox::pollOutsideTemp() {
-  byte ntc = pollVariable(VX_VARIABLE_T_OUTSIDE);
-  return ntc2Cel(ntc);
+int Vallox::getFaultCode() {
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_FAULT_CODE)];
 }
 
-int Vallox::pollIncomingTemp() {
-  byte ntc = pollVariable(VX_VARIABLE_T_INCOMING);
-  return ntc2Cel(ntc);
+int Vallox::getHeatingTarget() {
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_HEATING_TARGET)];
 }
 
-int Vallox::pollExhaustTemp() {
-  byte ntc = pollVariable(VX_VARIABLE_T_EXHAUST);
-  return ntc2Cel(ntc);
+int Vallox::getPostHeatingTarget() {
+  return devices[selected].values[VX_SLOT(VX_VARIABLE_POST_HEATING_TARGET)];
 }
 
-boolean Vallox::pollIsOn() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_POWER) != 0x00;
+// private
+
+// set generic variable value in the mainboard and all panels
+// and verify it later from the mainboard
+void Vallox::setVariable(byte device, byte variable, byte value) {
+  sendVariable(device, variable, value);
+  trackWrite(device, variable, value);
 }
 
-boolean Vallox::pollIsRhMode() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_RH) != 0x00;
+void Vallox::sendVariable(byte device, byte variable, byte value) {
+  byte message[VX_MSG_LENGTH];
+  byte address = devices[device].address;
+
+  message[0] = VX_MSG_DOMAIN;
+  message[1] = panel;
+  // with only one mainboard served, keep sending to all of them
+  message[2] = deviceCount == 1 ? VX_MSG_MAINBOARDS : address;
+  message[3] = variable;
+  message[4] = value;
+  message[5] = calculateCheckSum(message);
+
+  // send to the mainboard
+  for (int i = 0; i < VX_MSG_LENGTH; i++) {
+    serial->write(message[i]);
+  }
+
+  if (isDebug) {
+    Serial.print("TX: ");
+    prettyPrint(message);
+  }
+
+  message[1] = address;
+  message[2] = VX_MSG_PANELS;
+  message[5] = calculateCheckSum(message);
+
+  // send to all panels
+  for (int i = 0; i < VX_MSG_LENGTH; i++) {
+    serial->write(message[i]);
+  }
+
+  if(isDebug) {
+    Serial.print("Variable ");Serial.print(variable, HEX);
+	Serial.print(" set to ");Serial.print(value, HEX);
+    Serial.print(" in ");Serial.println(address, HEX);
+  }
 }
 
-boolean Vallox::pollIsHeatingMode() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_HEATING_MODE) != 0x00;
+void Vallox::setStatusFlag(byte flag, boolean on) {
+  if (on) {
+    setStatusFlags(flag, 0x00);
+  } else {
+    setStatusFlags(0x00, flag);
+  }
 }
 
-boolean Vallox::pollIsFilter() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_FILTER) != 0x00;
+// pending changes are visible before they are written
+boolean Vallox::isStatusFlag(byte flag) {
+  VxDevice* d = &devices[selected];
+  int status = d->values[VX_SLOT(VX_VARIABLE_STATUS)];
+  if (!vxIsSet(status)) {
+    return (d->statusSet & flag) != 0x00;
+  }
+
+  return (((status | d->statusSet) & ~d->statusClear) & flag) != 0x00;
 }
 
-boolean Vallox::pollIsHeating() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_HEATING) != 0x00;
+// write pending status flag changes in one message
+// the other flags come from the cache, or from a poll if the cache is stale
+void Vallox::processStatus(byte device) {
+  VxDevice* d = &devices[device];
+  if (d->statusSet == 0x00 && d->statusClear == 0x00) {
+    return;
+  }
+
+  byte slot = VX_SLOT(VX_VARIABLE_STATUS);
+  if (vxIsSet(d->values[slot]) && millis() - d->received[slot] <= statusMaxAge) {
+    byte status = (d->raw[slot] | d->statusSet) & ~d->statusClear;
+    d->statusSet = 0x00;
+    d->statusClear = 0x00;
+    d->statusPolled = false;
+
+    setVariable(device, VX_VARIABLE_STATUS, status);
+    d->raw[slot] = status;
+    d->received[slot] = millis();
+    checkChange(device, slot, status);
+  } else if (!isPollPending(device, VX_VARIABLE_STATUS)) {
+    if (!d->statusPolled) {
+      d->statusPolled = queuePoll(device, VX_VARIABLE_STATUS);
+    } else {
+      // the poll was given up, writing would overwrite unknown flags
+      if (isDebug) {
+        Serial.println("Status not available, flags not written");
+      }
+      d->statusSet = 0x00;
+      d->statusClear = 0x00;
+      d->statusPolled = false;
+    }
+  }
 }
 
-boolean Vallox::pollIsFault() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_FAULT) != 0x00;
+// write verification
+// a written value is polled back from the mainboard after VX_WRITE_SETTLE
+// and rewritten if it did not stick
+
+void Vallox::setWriteCallback(VxWriteCallback callback) {
+  writeCallback = callback;
 }
 
-boolean Vallox::pollIsService() {
-  byte status = pollVariable(VX_VARIABLE_STATUS);
-  return (status & VX_STATUS_FLAG_SERVICE) != 0x00;
+boolean Vallox::isWritePending(byte variable) {
+  for (int i = 0; i < writeCount; i++) {
+    if (writes[i].device == selected && writes[i].variable == variable) {
+      return true;
+    }
+  }
+
+  return false;
 }
 
-int Vallox::pollServicePeriod() {
-  return pollVariable(VX_VARIABLE_SERVICE_PERIOD);
+unsigned long Vallox::getWriteFailures() {
+  return writeFailures;
 }
 
-int Vallox::pollFanSpeed() {
-  byte speed = pollVariable(VX_VARIABLE_FAN_SPEED);
-  return hex2FanSpeed(speed);
+// a newer write of the same variable replaces the pending one
+void Vallox::trackWrite(byte device, byte variable, byte value) {
+  int i = 0;
+  while (i < writeCount && (writes[i].device != device || writes[i].variable != variable)) {
+    i++;
+  }
+
+  if (i == writeCount) {
+    if (writeCount >= VX_WRITE_QUEUE_SIZE) {
+      if (isDebug) {
+        Serial.print("Write not verified ");Serial.println(variable, HEX);
+      }
+      return;
+    }
+    writeCount++;
+  }
+
+  writes[i].device = device;
+  writes[i].variable = variable;
+  writes[i].value = value;
+  writes[i].retries = VX_WRITE_RETRIES;
+  writes[i].readBack = false;
+  writes[i].sent = millis();
 }
 
-int Vallox::pollDefaultFanSpeed() {
-  byte speed = pollVariable(VX_VARIABLE_DEFAULT_FAN_SPEED);
-  return hex2FanSpeed(speed);
+void Vallox::processWrites() {
+  unsigned long now = millis();
+
+  int i = 0;
+  while (i < writeCount) {
+    VxWrite* write = &writes[i];
+    if (!write->readBack) {
+      if (now - write->sent >= VX_WRITE_SETTLE) {
+        write->readBack = queuePoll(write->device, write->variable);
+      }
+    } else if (now - write->sent > VX_WRITE_TIMEOUT && !isPollPending(write->device, write->variable)) {
+      // read back was given up
+      int count = writeCount;
+      retryWrite(i);
+      if (writeCount < count) {
+        continue;
+      }
+    }
+    i++;
+  }
 }
 
-int Vallox::pollHeatingTarget() {
-  byte hex = pollVariable(VX_VARIABLE_HEATING_TARGET);
-  return hex2HtCel(hex);
+boolean Vallox::isReadingBack(byte device, byte variable) {
+  for (int i = 0; i < writeCount; i++) {
+    if (writes[i].device == device && writes[i].variable == variable && writes[i].readBack) {
+      return true;
+    }
+  }
+
+  return false;
 }
 
-boolean Vallox::pollIsSummerMode() {
-  byte io = pollVariable(VX_VARIABLE_IO_08);
-  return (io & 0x02) != 0x00;
+void Vallox::verifyWrite(byte device, byte variable, byte value) {
+  for (int i = 0; i < writeCount; i++) {
+    if (writes[i].device == device && writes[i].variable == variable && writes[i].readBack) {
+      // read only status flags may have changed meanwhile
+      byte mask = variable == VX_VARIABLE_STATUS ? VX_STATUS_FLAGS_WRITABLE : 0xFF;
+      if (((writes[i].value ^ value) & mask) == 0x00) {
+        completeWrite(i, true);
+      } else {
+        retryWrite(i);
+      }
+      return;
+    }
+  }
 }
 
-int Vallox::pollServiceCounter() {
-  return pollVariable(VX_VARIABLE_SERVICE_COUNTER);
+void Vallox::retryWrite(int i) {
+  VxWrite* write = &writes[i];
+  if (write->retries > 0) {
+    write->retries--;
+    write->readBack = false;
+    write->sent = millis();
+    sendVariable(write->device, write->variable, write->value);
+  } else {
+    writeFailures++;
+    // the cache may hold the value that was not written
+    queuePoll(write->device, write->variable);
+    completeWrite(i, false);
+  }
 }
 
-int Vallox::pollRh() {
-  byte hex = pollVariable(VX_VARIABLE_RH);
-  int rh = hex2Rh(hex);
+void Vallox::completeWrite(int i, boolean success) {
+  byte address = devices[writes[i].device].address;
+  byte variable = writes[i].variable;
+  byte value = writes[i].value;
+  writes[i] = writes[--writeCount];
 
-  if(rh >= 0 && rh <= 100) {
-    return rh;
-  } else {
-    return NOT_SET; 
+  if (isDebug) {
+    Serial.print("Write ");Serial.print(variable, HEX);
+    Serial.println(success ? " verified" : " failed");
+  }
+
+  if (writeCallback != NULL) {
+    writeCallback(address, variable, value, success);
   }
 }
 
-// set generic variable value in all mainboards and panels
-void Vallox::setVariable(byte variable, byte value) {
-  byte message[VX_MSG_LENGTH];
+// poll engine
+// polls are sent by loop(), at most VX_MAX_IN_FLIGHT at a time
 
-  message[0] = VX_MSG_DOMAIN;
-  message[1] = VX_MSG_PANEL_1;
-  message[2] = VX_MSG_MAINBOARDS;
-  message[3] = variable;
-  message[4] = value;
-  message[5] = calculateCheckSum(message);
+// queue a poll unless the same variable is already pending
+boolean Vallox::queuePoll(byte device, byte variable) {
+  byte slot = pgm_read_byte(&vxSlots[variable]);
+  if (slot == VX_SLOT_NONE || !(pgm_read_byte(&vxVariables[slot].access) & VX_ACCESS_READ)) {
+    return false;
+  }
 
-  // send to all mainboards
-  for (int i = 0; i < VX_MSG_LENGTH; i++) {
-    serial->write(message[i]);
+  if (isPollPending(device, variable)) {
+    return true;
   }
-  
-  if (isDebug) {
-    Serial.print("TX: ");		  
-    prettyPrint(message);
+
+  if (pollQueueCount >= VX_POLL_QUEUE_SIZE) {
+    return false;
   }
 
-  message[1] = VX_MSG_MAINBOARD_1;
-  message[2] = VX_MSG_PANELS;
-  message[5] = calculateCheckSum(message);
+  VxPollRequest* request = &pollQueue[(pollQueueHead + pollQueueCount) % VX_POLL_QUEUE_SIZE];
+  request->device = device;
+  request->variable = variable;
+  pollQueueCount++;
 
-  // send to all panels
-  for (int i = 0; i < VX_MSG_LENGTH; i++) {
-    serial->write(message[i]);
+  return true;
+}
+
+boolean Vallox::isPollPending(byte device, byte variable) {
+  for (int i = 0; i < pollQueueCount; i++) {
+    VxPollRequest* request = &pollQueue[(pollQueueHead + i) % VX_POLL_QUEUE_SIZE];
+    if (request->device == device && request->variable == variable) {
+      return true;
+    }
   }
 
-  if(isDebug) {
-    Serial.print("Variable ");Serial.print(variable, HEX);
-	Serial.print(" set to ");Serial.println(value, HEX);
+  for (int i = 0; i < inFlightCount; i++) {
+    if (inFlight[i].device == device && inFlight[i].variable == variable) {
+      return true;
+    }
   }
+
+  return false;
 }
 
-// poll variable value from mainboard 1
-byte Vallox::pollVariable(byte variable) {
-  byte value = 0x00;
-  
-  while(!pollVariable2(variable, &value)) {
-    delay(500);
+void Vallox::processPolls() {
+  unsigned long now = millis();
+
+  // resend or give up polls that were not answered in time
+  int i = 0;
+  while (i < inFlightCount) {
+    if (now - inFlight[i].sent > VX_POLL_TIMEOUT) {
+      if (inFlight[i].retries > 0) {
+        inFlight[i].retries--;
+        inFlight[i].sent = now;
+        sendPoll(inFlight[i].device, inFlight[i].variable);
+      } else {
+        if (isDebug) {
+          Serial.print("Poll failed ");Serial.println(inFlight[i].variable, HEX);
+        }
+        pollFailures++;
+        inFlight[i] = inFlight[--inFlightCount];
+        continue;
+      }
+    }
+    i++;
   }
-  
-  if(isDebug) {
-    Serial.print("Polled variable ");Serial.print(variable, HEX);
-	Serial.print(" = ");Serial.println(value, HEX);
+
+  // send queued polls as long as there is room in flight
+  while (inFlightCount < VX_MAX_IN_FLIGHT && pollQueueCount > 0) {
+    VxPollRequest request = pollQueue[pollQueueHead];
+    pollQueueHead = (pollQueueHead + 1) % VX_POLL_QUEUE_SIZE;
+    pollQueueCount--;
+
+    inFlight[inFlightCount].device = request.device;
+    inFlight[inFlightCount].variable = request.variable;
+    inFlight[inFlightCount].retries = VX_POLL_RETRIES;
+    inFlight[inFlightCount].sent = now;
+    inFlightCount++;
+    sendPoll(request.device, request.variable);
+  }
+}
+
+// poll data that can change without notice
+// one due variable at a time and only in a gap of the bus traffic, so the
+// scheduled polls spread out instead of bursting and never delay the
+// polls requested by init(), writes or the user
+void Vallox::processSchedule() {
+  unsigned long now = millis();
+  if (!ready || pollQueueCount > 0 || inFlightCount > 0 || now - lastReceived < VX_BUS_IDLE) {
+    return;
+  }
+
+  // most overdue variable of all mainboards first
+  int dueDevice = -1;
+  int due = -1;
+  unsigned long dueFor = 0;
+  for (int device = 0; device < deviceCount; device++) {
+    VxDevice* d = &devices[device];
+    for (int slot = 0; slot < VX_VARIABLE_COUNT; slot++) {
+      VxSchedule* s = &d->schedule[slot];
+      if (s->interval == 0) {
+        continue;
+      }
+
+      // a value received by other means is as good as a poll
+      unsigned long last = s->polled;
+      if (vxIsSet(d->values[slot]) && (long)(d->received[slot] - last) > 0) {
+        last = d->received[slot];
+      }
+
+      unsigned long elapsed = now - last;
+      if (elapsed >= s->interval && (due < 0 || elapsed - s->interval > dueFor)) {
+        dueDevice = device;
+        due = slot;
+        dueFor = elapsed - s->interval;
+      }
+    }
+  }
+
+  if (due < 0) {
+    return;
   }
 
-  return value;
+  // backs off until checkChange() sees a change
+  VxSchedule* s = &devices[dueDevice].schedule[due];
+  s->interval *= 2;
+  if (s->interval > POLL_INTERVAL) {
+    s->interval = POLL_INTERVAL;
+  }
+  s->polled = now;
+
+  queuePoll(dueDevice, pgm_read_byte(&vxVariables[due].id));
 }
 
-boolean Vallox::pollVariable2(byte variable, byte* value) {
-  boolean ret = false;
+// any message from the mainboard carrying the variable answers the poll,
+// except broadcasts while the variable is read back after a write
+void Vallox::completePoll(byte device, byte variable) {
+  for (int i = 0; i < inFlightCount; i++) {
+    if (inFlight[i].device == device && inFlight[i].variable == variable) {
+      inFlight[i] = inFlight[--inFlightCount];
+      return;
+    }
+  }
+}
 
+// send poll request to the mainboard
+void Vallox::sendPoll(byte device, byte variable) {
   byte message[VX_MSG_LENGTH];
   message[0] = VX_MSG_DOMAIN;
-  message[1] = VX_MSG_PANEL_1;
-  message[2] = VX_MSG_MAINBOARD_1;
+  message[1] = panel;
+  message[2] = devices[device].address;
   message[3] = VX_MSG_POLL_BYTE;
   message[4] = variable;
   message[5] = calculateCheckSum(message);
@@ -426,195 +882,133 @@ boolean Vallox::pollVariable2(byte variable, byte* value) {
   }
 
   if (isDebug) {
-    Serial.print("TX: ");		  
+    Serial.print("TX: ");
     prettyPrint(message);
   }
-
-  // leave time for the reply to arrive
-  delay(10);
-  
-  byte reply[VX_MSG_LENGTH];
-  while (readMessage(reply)) {
-    if (reply[1] == VX_MSG_MAINBOARD_1 && reply[2] == VX_MSG_PANEL_1 && reply[3] == variable) {
-      *value = reply[4];
-	  ret = true;	
-      break;
-    }
-  }
-
-  return ret;
 }
 
 // tries to read one full message
 // returns true if a message was read, false otherwise
 boolean Vallox::readMessage(byte message[]) {
-  boolean ret = false;
-
-  if (serial->available() >= VX_MSG_LENGTH) {
-    message[0] = serial->read();
-
-    if (message[0] == VX_MSG_DOMAIN) {
-      message[1] = serial->read();
-      message[2] = serial->read();
-
-      // accept messages from mainboard 1 or panel 1
-      // accept messages to panel 1, mainboard 1 or to all panels and mainboards
-      if ((message[1] == VX_MSG_MAINBOARD_1 || message[1] == VX_MSG_PANEL_1) &&
-          (message[2] == VX_MSG_PANELS || message[2] == VX_MSG_PANEL_1 ||
-           message[2] == VX_MSG_MAINBOARD_1 || message[2] == VX_MSG_MAINBOARDS)) {
-        int i = 3;
-        // read the rest of the message
-        while (i < VX_MSG_LENGTH) {
-          message[i++] = serial->read();
-        }
-
-        if (isDebug) {
-          Serial.print("RX: ");		  
-          prettyPrint(message);
-        }
-
-        ret = true;
+  while (parser.read(serial)) {
+    memcpy(message, parser.getMessage(), VX_MSG_LENGTH);
+    countTraffic(message);
+
+    // accept messages from our mainboards to the panels, to us or to mainboards
+    // accept messages from panels to our mainboards or to all panels and mainboards
+    boolean toGroup = message[2] == VX_MSG_PANELS || message[2] == VX_MSG_MAINBOARDS;
+    boolean fromPanel = message[1] > VX_MSG_PANELS && message[1] <= VX_MSG_MAX_ADDRESS;
+    if ((findMainboard(message[1]) >= 0 &&
+         (toGroup || message[2] == panel || findMainboard(message[2]) >= 0)) ||
+        (fromPanel && (toGroup || findMainboard(message[2]) >= 0))) {
+      if (isDebug) {
+        Serial.print("RX: ");
+        prettyPrint(message);
       }
+
+      return true;
     }
   }
 
-  return ret;
+  return false;
 }
 
-void Vallox::decodeMessage(const byte message[]) {
-  // decode variable in message
-  byte variable = message[3];
-  byte value = message[4];
-  unsigned long now = millis();
+void Vallox::handleMessage(const byte message[]) {
+  int device = findMainboard(message[1]);
+  if (device >= 0) {
+    decodeMessage(device, message);
 
-  if (variable == VX_VARIABLE_T_OUTSIDE) {
-    checkChange(&(data.t_outside), ntc2Cel(value));
-  } else if (variable == VX_VARIABLE_T_EXHAUST) {
-    checkChange(&(data.t_exhaust), ntc2Cel(value));
-  } else if (variable == VX_VARIABLE_T_INSIDE) {
-    checkChange(&(data.t_inside), ntc2Cel(value));
-  } else if (variable == VX_VARIABLE_T_INCOMING) {
-    checkChange(&(data.t_incoming), ntc2Cel(value));
-  } else if (variable == VX_VARIABLE_FAN_SPEED) {
-    checkChange(&(data.fan_speed), hex2FanSpeed(value));
-  } else if (variable == VX_VARIABLE_DEFAULT_FAN_SPEED) {
-    checkChange(&(data.default_fan_speed), hex2FanSpeed(value));
-  } else if (variable == VX_VARIABLE_STATUS) {
-    decodeStatus(value);
-  } else if (variable == VX_VARIABLE_IO_08) {
-    checkChange(&(data.is_summer_mode), (value & 0x01) != 0x00);
-  } else if (variable == VX_VARIABLE_SERVICE_PERIOD) {
-    checkChange(&(data.service_period), value);
-  } else if (variable == VX_VARIABLE_SERVICE_COUNTER) {
-    checkChange(&(data.service_counter), value);
-  } else if (variable == VX_VARIABLE_RH) {
-    checkChange(&(data.rh), hex2Rh(value));
-  } else if (variable == VX_VARIABLE_HEATING_TARGET) {
-    checkChange(&(data.heating_target), hex2HtCel(value));
+    // only poll replies are trusted for verification, broadcasts to
+    // panels look the same as the ones sent by setVariable() and leave
+    // the read back poll waiting for its reply
+    if (message[2] == panel) {
+      completePoll(device, message[3]);
+      verifyWrite(device, message[3], message[4]);
+    } else if (!isReadingBack(device, message[3])) {
+      completePoll(device, message[3]);
+    }
   } else {
-    // variable not recognized
-  }
-}
-
-void Vallox::decodeStatus(byte status) {
-  unsigned long now = millis();
-  
-  checkChange(&(data.is_on), (status & VX_STATUS_FLAG_POWER) != 0x00);
-  checkChange(&(data.is_rh_mode), (status & VX_STATUS_FLAG_RH) != 0x00);
-  checkChange(&(data.is_heating_mode), (status & VX_STATUS_FLAG_HEATING_MODE) != 0x00);
-  checkChange(&(data.is_filter), (status & VX_STATUS_FLAG_FILTER) != 0x00);
-  checkChange(&(data.is_heating), (status & VX_STATUS_FLAG_HEATING) != 0x00);
-  checkChange(&(data.is_fault), (status & VX_STATUS_FLAG_FAULT) != 0x00);
-  checkChange(&(data.is_service), (status & VX_STATUS_FLAG_SERVICE) != 0x00);
-}
-
-int Vallox::ntc2Cel(byte ntc) {
-  int i = (int)ntc;
-  return vxTemps[i];
-}
-
-byte Vallox::cel2Ntc(int cel) {
-  for (int i = 0; i < 256; i++) {
-    if(vxTemps[i] == cel) {
-      return i;
+    // a panel sets the value in one or all mainboards
+    device = findMainboard(message[2]);
+    if (device >= 0) {
+      decodeMessage(device, message);
+    } else {
+      for (device = 0; device < deviceCount; device++) {
+        decodeMessage(device, message);
+      }
     }
   }
-
-  // we should not be here, return 10 Cel as default
-  return 0x83;
 }
 
-byte Vallox::fanSpeed2Hex(int fan) {
-  if (fan > 0 && fan < 9) {
-    return vxFanSpeeds[fan - 1];
+// decode variable in message through the registry
+void Vallox::decodeMessage(byte device, const byte message[]) {
+  byte slot = pgm_read_byte(&vxSlots[message[3]]);
+  if (slot != VX_SLOT_NONE) {
+    byte codec = pgm_read_byte(&vxVariables[slot].codec);
+    devices[device].raw[slot] = message[4];
+    devices[device].received[slot] = millis();
+    checkChange(device, slot, decodeValue(codec, message[4]));
   }
-
-  // we should not be here, return speed 1 as default
-  return VX_FAN_SPEED_1;
 }
 
-int Vallox::hex2FanSpeed(byte hex) {
-  for (int i = 0; i < sizeof(vxFanSpeeds); i++) {
-    if (vxFanSpeeds[i] == hex) {
-      return i + 1;
-    }
+void Vallox::countTraffic(const byte message[]) {
+  // the parser only accepts addresses in range
+  traffic[message[1] - VX_MSG_MIN_ADDRESS].from++;
+  traffic[message[1] - VX_MSG_MIN_ADDRESS].seen = millis();
+  traffic[message[2] - VX_MSG_MIN_ADDRESS].to++;
+}
+
+int Vallox::decodeValue(byte codec, byte hex) {
+  switch (codec) {
+    case VX_CODEC_NTC:
+      return vxNtc2Cel(hex);
+    case VX_CODEC_FAN:
+      return vxHex2FanSpeed(hex);
+    case VX_CODEC_RH:
+      return vxHex2Rh(hex);
+    case VX_CODEC_HT:
+      return vxHex2HtCel(hex);
+    default:
+      return hex;
   }
-
-  return NOT_SET;
 }
 
-int Vallox::hex2Rh(byte hex) {
-  if (hex >= 51) {
-    return (hex - 51) / 2.04;
-  } else {
-    return NOT_SET;
+// returns false if the value cannot be presented in the codec
+boolean Vallox::encodeValue(byte codec, int value, byte* hex) {
+  switch (codec) {
+    case VX_CODEC_NTC:
+      if (value < VX_NTC_MIN_CEL || value > VX_NTC_MAX_CEL) {
+        return false;
+      }
+      *hex = vxCel2Ntc(value);
+      return true;
+    case VX_CODEC_FAN:
+      if (value < VX_MIN_FAN_SPEED || value > VX_MAX_FAN_SPEED) {
+        return false;
+      }
+      *hex = vxFanSpeed2Hex(value);
+      return true;
+    case VX_CODEC_RH:
+      if (value < 0 || value > 100) {
+        return false;
+      }
+      *hex = vxRh2Hex(value);
+      return true;
+    case VX_CODEC_HT:
+      if (value < VX_MIN_HEATING_TARGET || value > VX_MAX_HEATING_TARGET) {
+        return false;
+      }
+      *hex = vxHtCel2Hex(value);
+      return true;
+    default:
+      if (value < 0 || value > 255) {
+        return false;
+      }
+      *hex = value;
+      return true;
   }
 }
 
-int Vallox::hex2HtCel(byte hex) {
-  if (hex == 0x01) {
-    return 10;
-  } else if (hex == 0x03) {
-    return 13;
-  } else if (hex == 0x07) {
-    return 15;
-  } else if (hex == 0x0F) {
-    return 18;
-  } else if (hex == 0x1F) {
-    return 20;
-  } else if (hex == 0x3F) {
-    return 23;
-  } else if (hex == 0x7F) {
-    return 25;
-  } else if (hex == 0xFF) {
-    return 27;
-  } else {
-	return NOT_SET;
-  }
-}
-
-byte Vallox::htCel2Hex(int htCel) {
-  if (htCel < 13) {
-    return 0x01;
-  } else if (htCel < 15) {
-    return 0x03;	  
-  } else if (htCel < 18) {
-    return 0x07;	  
-  } else if (htCel < 20) {
-    return 0x0F;	  
-  } else if (htCel < 23) {
-    return 0x1F;	  
-  } else if (htCel < 25) {
-    return 0x3F;	  
-  } else if (htCel < 27) {
-    return 0x7F;	  
-  } else if (htCel == 27) {
-    return 0xFF;
-  } else {
-    return 0x01;
-  }	  
-}
-
 // calculate VX message checksum
 byte Vallox::calculateCheckSum(const byte message[]) {
   byte ret = 0x00;
@@ -625,17 +1019,38 @@ byte Vallox::calculateCheckSum(const byte message[]) {
   return ret;
 }
 
-void Vallox::checkChange(boolean* oldValue, boolean newValue) {
-  if(*oldValue != newValue) {
-    *oldValue = newValue;
-	data.updated = millis();
+int Vallox::findMainboard(byte address) {
+  for (int device = 0; device < deviceCount; device++) {
+    if (devices[device].address == address) {
+      return device;
+    }
   }
+
+  return -1;
 }
 
-void Vallox::checkChange(int* oldValue, int newValue) {
-  if(*oldValue != newValue) {
-    *oldValue = newValue;
-	data.updated = millis();
+void Vallox::checkChange(byte device, byte slot, int newValue) {
+  VxDevice* d = &devices[device];
+  int oldValue = d->values[slot];
+  if(oldValue != newValue) {
+    d->values[slot] = newValue;
+	d->updated = millis();
+    d->changed |= 1UL << slot;
+
+    // poll a scheduled variable again soon after it changed
+    VxSchedule* s = &d->schedule[slot];
+    if (s->interval != 0) {
+      s->interval = VX_POLL_MIN_INTERVAL;
+      s->polled = d->updated;
+    }
+
+    if (slot == VX_SLOT(VX_VARIABLE_STATUS)) {
+      d->changedStatusFlags |= vxIsSet(oldValue) ? (oldValue ^ newValue) : 0xFF;
+    }
+
+    if (changeCallback != NULL) {
+      changeCallback(d->address, pgm_read_byte(&vxVariables[slot].id), oldValue, newValue);
+    }
   }
 }
 
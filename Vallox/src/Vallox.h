@@ -7,32 +7,97 @@
 
 #include <Arduino.h>
 #include <SoftwareSerial.h>
+#include "ValloxCodec.h"
 
 #define VX_MSG_LENGTH 6
 #define VX_MSG_DOMAIN 0x01
 #define VX_MSG_POLL_BYTE 0x00
-#define NOT_SET -999
-#define POLL_INTERVAL 600000 // in ms
+#define POLL_INTERVAL 600000 // in ms, longest interval of scheduled polls
+
+// poll engine
+#define VX_POLL_QUEUE_SIZE (24 * VX_MAX_MAINBOARDS) // max number of queued polls, room for all init polls
+#define VX_MAX_IN_FLIGHT 1    // max number of unanswered polls in the bus
+#define VX_POLL_TIMEOUT 100   // in ms
+#define VX_POLL_RETRIES 3     // resends before a poll is given up
+
+// poll scheduler for variables that are not broadcast
+// the interval doubles while a value stays the same and drops back
+// to the minimum when it changes
+#define VX_POLL_MIN_INTERVAL 15000 // in ms
+#define VX_BUS_IDLE 20             // in ms without traffic before a scheduled poll
+
+// status writes
+#define VX_STATUS_MAX_AGE 10000 // in ms, older cached status is polled first
+
+// write verification
+#define VX_WRITE_QUEUE_SIZE 8 // max number of unverified writes
+#define VX_WRITE_SETTLE 100   // in ms, before the written value is read back
+#define VX_WRITE_TIMEOUT 1000 // in ms, for the read back to arrive
+#define VX_WRITE_RETRIES 2    // rewrites before a write is failed
 
 // senders and receivers
 #define VX_MSG_MAINBOARD_1 0x11
 #define VX_MSG_MAINBOARDS 0x10
 #define VX_MSG_PANEL_1 0x21
 #define VX_MSG_PANELS 0x20
+#define VX_MSG_MIN_ADDRESS 0x10 // all mainboards
+#define VX_MSG_MAX_ADDRESS 0x2F // last panel
+#define VX_MSG_MAX_MAINBOARD 0x1F // last mainboard
+#define VX_ADDRESS_COUNT (VX_MSG_MAX_ADDRESS - VX_MSG_MIN_ADDRESS + 1)
+
+// devices
+#define VX_MAX_MAINBOARDS 4 // mainboards served by one node, each has its own cache
 
 // variables
-#define VX_VARIABLE_STATUS 0xA3
+// see the variable registry in Vallox.cpp for codecs and access
+#define VX_VARIABLE_IO_06 0x06
+#define VX_VARIABLE_IO_07 0x07
+#define VX_VARIABLE_IO_08 0x08
 #define VX_VARIABLE_FAN_SPEED 0x29
-#define VX_VARIABLE_DEFAULT_FAN_SPEED 0xA9
+#define VX_VARIABLE_CO2_HI 0x2B
+#define VX_VARIABLE_CO2_LO 0x2C
+#define VX_VARIABLE_FAULT_CODE 0x36
 #define VX_VARIABLE_RH 0x4C
-#define VX_VARIABLE_SERVICE_PERIOD 0xA6
-#define VX_VARIABLE_SERVICE_COUNTER 0xAB
+#define VX_VARIABLE_POST_HEATING_ON 0x55
+#define VX_VARIABLE_POST_HEATING_OFF 0x56
+#define VX_VARIABLE_POST_HEATING_TARGET 0x57
 #define VX_VARIABLE_T_OUTSIDE 0x58
 #define VX_VARIABLE_T_INSIDE 0x5A
-#define VX_VARIABLE_T_EXHAUST 0x5C
 #define VX_VARIABLE_T_INCOMING 0x5B
-#define VX_VARIABLE_IO_08 0x08
+#define VX_VARIABLE_T_EXHAUST 0x5C
+#define VX_VARIABLE_STATUS 0xA3
 #define VX_VARIABLE_HEATING_TARGET 0xA4
+#define VX_VARIABLE_MAX_FAN_SPEED 0xA5
+#define VX_VARIABLE_SERVICE_PERIOD 0xA6
+#define VX_VARIABLE_PREHEATING_TARGET 0xA7
+#define VX_VARIABLE_INPUT_FAN_STOP 0xA8
+#define VX_VARIABLE_DEFAULT_FAN_SPEED 0xA9
+#define VX_VARIABLE_PROGRAM 0xAA
+#define VX_VARIABLE_SERVICE_COUNTER 0xAB
+#define VX_VARIABLE_BASIC_RH 0xAE
+#define VX_VARIABLE_BYPASS_TEMP 0xAF
+#define VX_VARIABLE_CO2_SET_POINT_HI 0xB3
+#define VX_VARIABLE_CO2_SET_POINT_LO 0xB4
+#define VX_VARIABLE_COUNT 28 // number of variables in the registry
+
+// variable codecs
+#define VX_CODEC_RAW 0 // value as is
+#define VX_CODEC_NTC 1 // NTC temperature
+#define VX_CODEC_FAN 2 // fan speed bitmask
+#define VX_CODEC_RH 3  // relative humidity
+#define VX_CODEC_HT 4  // heating target bitmask
+
+// variable access flags
+#define VX_ACCESS_READ 0x01  // can be polled
+#define VX_ACCESS_WRITE 0x02 // can be set
+#define VX_ACCESS_INIT 0x04  // polled by init()
+#define VX_ACCESS_POLL 0x08  // not broadcast, polled by the scheduler
+
+// flags of variable 07
+#define VX_IO_07_FLAG_POST_HEATING 0x20     // bit 5 read
+
+// flags of variable 08
+#define VX_IO_08_FLAG_SUMMER_MODE 0x02      // bit 1 read
 
 // status flags of variable A3
 #define VX_STATUS_FLAG_POWER 0x01           // bit 0 read/write
@@ -42,19 +107,48 @@
 #define VX_STATUS_FLAG_FILTER 0x10          // bit 4 read
 #define VX_STATUS_FLAG_HEATING 0x20         // bit 5 read
 #define VX_STATUS_FLAG_FAULT 0x40           // bit 6 read
-#define VX_STATUS_FLAG_SERVICE 0x80         // bit 7 read             
-
-// fan speeds
-#define VX_FAN_SPEED_1 0x01
-#define VX_FAN_SPEED_2 0x03
-#define VX_FAN_SPEED_3 0x07
-#define VX_FAN_SPEED_4 0x0F
-#define VX_FAN_SPEED_5 0x1F
-#define VX_FAN_SPEED_6 0x3F
-#define VX_FAN_SPEED_7 0x7F
-#define VX_FAN_SPEED_8 0xFF
-#define VX_MIN_FAN_SPEED 1
-#define VX_MAX_FAN_SPEED 8
+#define VX_STATUS_FLAG_SERVICE 0x80         // bit 7 read
+#define VX_STATUS_FLAGS_WRITABLE 0x0F
+
+// incremental parser for VX messages
+// keeps a sliding window of the last bytes and resyncs one byte at a time
+// until the domain, addresses and checksum of a full message match
+class ValloxParser {
+  public:
+    ValloxParser();
+
+    // feed one byte, returns true when it completed a valid message
+    boolean feed(byte b);
+    // feed bytes from the stream until a message is complete
+    // returns false when the stream ran out of data first
+    boolean read(Stream* stream);
+    // last valid message, VX_MSG_LENGTH bytes
+    const byte* getMessage();
+
+    // statistics
+    unsigned long getAccepted(); // valid messages
+    unsigned long getCorrupt();  // well formed messages with a bad checksum
+    unsigned long getDropped();  // bytes discarded while resyncing
+    void resetCounters();
+
+  private:
+    byte window[VX_MSG_LENGTH];
+    byte length = 0;
+    byte message[VX_MSG_LENGTH];
+    unsigned long accepted = 0;
+    unsigned long corrupt = 0;
+    unsigned long dropped = 0;
+
+    boolean isValidPrefix();
+    void shift();
+};
+
+// called when a write has been read back from the mainboard
+// or given up after VX_WRITE_RETRIES
+typedef void (*VxWriteCallback)(byte mainboard, byte variable, byte value, boolean success);
+
+// called when a decoded value in the cache of a mainboard changes
+typedef void (*VxChangeCallback)(byte mainboard, byte variable, int oldValue, int newValue);
 
 class Vallox {
   public:
@@ -62,14 +156,56 @@ class Vallox {
     Vallox(byte rx, byte tx); // RX & TX pins for SoftwareSerial e.g. D1 & D2
     Vallox(byte rx, byte tx, boolean isDebug);
 
-    // initializes data by polling
+    // devices, call before init()
+    // mainboard 1 is always served and our node talks as panel 1 by default
+    boolean addMainboard(byte address); // another mainboard, up to VX_MAX_MAINBOARDS
+    boolean setPanelAddress(byte address); // our own address in the bus
+    byte getPanelAddress();
+    byte getMainboardCount();
+    byte getMainboardAddress(byte index);
+    // getters, setters, polls and change tracking use the selected mainboard
+    boolean selectMainboard(byte address);
+    byte getSelectedMainboard();
+
+    // starts polling the initial data
     // call only once and use loop() afterwards to keep up-to-date
     void init();
     // listen bus for data that arrives without polling
+    // and run the poll engine, never blocks
     void loop();
+    // true when the initial polls have been answered or given up
+    boolean isReady();
+    // queue a poll, the reply is decoded into the cache by loop()
+    // returns false if the queue is full or the variable is not readable
+    boolean requestPoll(byte variable);
+    // number of polls given up after all retries
+    unsigned long getPollFailures();
+    // current interval of a scheduled variable in ms, 0 if not scheduled
+    unsigned long getPollInterval(byte variable);
+    // bus statistics from the message parser
+    unsigned long getAcceptedMessages();
+    unsigned long getCorruptMessages();
+    unsigned long getDroppedBytes();
+    // valid messages per address, group addresses count as receivers
+    unsigned long getMessagesFrom(byte address);
+    unsigned long getMessagesTo(byte address);
+    unsigned long getLastSeen(byte address); // time of the last message from the address
+
+    // checksum of the first VX_MSG_LENGTH - 1 bytes of a message
+    static byte calculateCheckSum(const byte message[]);
+
+    // changes since the last clearChanged()
+    // consumers can publish only the variables that changed
+    void setChangeCallback(VxChangeCallback callback);
+    boolean hasChanges();
+    boolean isChanged(byte variable);
+    byte getChangedStatusFlags(); // bits of variable A3 that changed
+    void clearChanged();
 
     // get data from cache
     unsigned long getUpdated(); // time when data was last updated
+    int getValue(byte variable); // any registered variable, decoded
+    int getTempTenths(byte variable); // NTC variable in 1/10 Cel
     int getInsideTemp();
     int getOutsideTemp();
     int getIncomingTemp();
@@ -82,14 +218,21 @@ class Vallox {
     boolean isHeating();
     boolean isFault();
     boolean isServiceNeeded();
+    boolean isPostHeating();
+    boolean isStatusFlag(byte flag); // any VX_STATUS_FLAG_*, with pending changes
     int getFanSpeed();
     int getDefaultFanSpeed();
+    int getMaxFanSpeed();
     int getRh();
+    int getCo2();
+    int getFaultCode();
     int getServicePeriod();
     int getServiceCounter();
     int getHeatingTarget();
+    int getPostHeatingTarget();
 
     // set data in Vallox bus
+    boolean setValue(byte variable, int value); // any writable variable, decoded
     void setFanSpeed(int speed);
     void setDefaultFanSpeed(int speed);
     void setOn();
@@ -101,83 +244,128 @@ class Vallox {
     void setServicePeriod(int months);
     void setServiceCounter(int months);
     void setHeatingTarget(int temp);
+    // status flag changes are collected and written by loop() in one
+    // message, on top of the cached status if it is fresh enough
+    void setStatusFlags(byte set, byte clear);
+    void setStatusMaxAge(unsigned long maxAge); // in ms
+
+    // writes are verified by reading the value back from the mainboard written to
+    void setWriteCallback(VxWriteCallback callback);
+    boolean isWritePending(byte variable);
+    unsigned long getWriteFailures(); // writes given up after all retries
 
   private:
     SoftwareSerial* serial;
+    ValloxParser parser;
     boolean isDebug = false;
-	unsigned long lastPolled = 0;
-    
-    // data cache
-    struct {
+    boolean ready = false;
+    byte panel = VX_MSG_PANEL_1;
+    unsigned long pollFailures = 0;
+    unsigned long lastReceived = 0; // time of the last byte from the bus
+    unsigned long statusMaxAge = VX_STATUS_MAX_AGE;
+
+    // poll engine
+    struct VxPollRequest {
+      byte device;
+      byte variable;
+    };
+    struct VxPoll {
+      byte device;
+      byte variable;
+      byte retries;
+      unsigned long sent;
+    };
+    VxPollRequest pollQueue[VX_POLL_QUEUE_SIZE];
+    byte pollQueueHead = 0;
+    byte pollQueueCount = 0;
+    VxPoll inFlight[VX_MAX_IN_FLIGHT];
+    byte inFlightCount = 0;
+
+    // poll scheduler, per registry slot
+    struct VxSchedule {
+      unsigned long interval; // 0 if not scheduled
+      unsigned long polled;   // the interval counts from here, last poll or change
+    };
+
+    // writes waiting for verification
+    struct VxWrite {
+      byte device;
+      byte variable;
+      byte value;
+      byte retries;
+      boolean readBack; // read back poll requested
+      unsigned long sent;
+    };
+    VxWrite writes[VX_WRITE_QUEUE_SIZE];
+    byte writeCount = 0;
+    unsigned long writeFailures = 0;
+    VxWriteCallback writeCallback = NULL;
+    VxChangeCallback changeCallback = NULL;
+
+    // one mainboard, the data cache has one decoded value per registry slot
+    struct VxDevice {
+      byte address;
       unsigned long updated;
+      int values[VX_VARIABLE_COUNT];
+      byte raw[VX_VARIABLE_COUNT]; // as received, valid when value is set
+      unsigned long received[VX_VARIABLE_COUNT]; // time of the last value from the bus
+      unsigned long changed; // bit per slot
+      byte changedStatusFlags;
+
+      // pending status flag changes
+      byte statusSet;
+      byte statusClear;
+      boolean statusPolled;
 
-      boolean is_on;
-      boolean is_rh_mode;
-      boolean is_heating_mode;
-      boolean is_summer_mode;
-      boolean is_filter;
-      boolean is_heating;
-      boolean is_fault;
-      boolean is_service;
-
-      int t_outside;
-      int t_inside;
-      int t_exhaust;
-      int t_incoming;
-
-      int fan_speed;
-      int default_fan_speed;
-      int rh;
-      int service_period;
-      int service_counter;
-      int heating_target;
-    } data;
+      VxSchedule schedule[VX_VARIABLE_COUNT];
+    };
+    VxDevice devices[VX_MAX_MAINBOARDS];
+    byte deviceCount = 1;
+    byte selected = 0;
+
+    // bus traffic per address
+    struct VxTraffic {
+      unsigned long from;
+      unsigned long to;
+      unsigned long seen;
+    };
+    VxTraffic traffic[VX_ADDRESS_COUNT];
 
 	// generic setter
-    void setVariable(byte variable, byte value);
-	
-    // pollers
-    boolean pollIsOn();
-    boolean pollIsRhMode();
-    boolean pollIsHeatingMode();
-    boolean pollIsFilter();
-    boolean pollIsHeating();
-    boolean pollIsFault();
-    boolean pollIsService();
-    boolean pollIsSummerMode();
-	int pollInsideTemp();
-	int pollOutsideTemp();
-	int pollIncomingTemp();
-	int pollExhaustTemp();
-    int pollFanSpeed();
-    int pollDefaultFanSpeed();
-    int pollServicePeriod();
-    int pollHeatingTarget();
-    int pollRh();
-    int pollServiceCounter();
-
-	// generic poller
-    byte pollVariable(byte variable);
-    boolean pollVariable2(byte variable, byte* value);
+    void setVariable(byte device, byte variable, byte value);
+    void sendVariable(byte device, byte variable, byte value);
+    void setStatusFlag(byte flag, boolean on);
+    void processStatus(byte device);
+
+    // poll engine
+    boolean queuePoll(byte device, byte variable);
+    boolean isPollPending(byte device, byte variable);
+    void processPolls();
+    void processSchedule();
+    void completePoll(byte device, byte variable);
+    void sendPoll(byte device, byte variable);
+
+    // write verification
+    void trackWrite(byte device, byte variable, byte value);
+    void processWrites();
+    boolean isReadingBack(byte device, byte variable);
+    void verifyWrite(byte device, byte variable, byte value);
+    void retryWrite(int i);
+    void completeWrite(int i, boolean success);
 
     // conversions
-    static byte fanSpeed2Hex(int fan);
-    static int hex2FanSpeed(byte hex);
-    static int ntc2Cel(byte ntc);
-    static byte cel2Ntc(int cel);
-    static int hex2Rh(byte hex);
-    static int hex2HtCel(byte hex);
-    static byte htCel2Hex(int htCel);
+    static int decodeValue(byte codec, byte hex);
+    static boolean encodeValue(byte codec, int value, byte* hex);
 
     // read and decode messages
     boolean readMessage(byte message[]);
-    void decodeMessage(const byte message[]);
-    void decodeStatus(byte status);
+    void handleMessage(const byte message[]);
+    void decodeMessage(byte device, const byte message[]);
+    void countTraffic(const byte message[]);
 
     // helpers
-    void checkChange(boolean* oldValue, boolean newValue);
-    void checkChange(int* oldValue, int newValue);
-    static byte calculateCheckSum(const byte message[]);
+    int findMainboard(byte address); // device index or -1
+    void checkChange(byte device, byte slot, int newValue);
     void prettyPrint(const byte message[]);
 };
 
@@ -185,4 +373,3 @@ class Vallox {
 boolean vxIsSet(int value);
 
 #endif
-
@@ -0,0 +1,215 @@
+// =======================================
+// VALLOX DIGIT SE VALUE CONVERSIONS
+// =======================================
+
+#include "ValloxCodec.h"
+
+// source tables
+// the lookup tables below are generated from these at compile time
+
+// VX fan speed (1-8) conversion table
+constexpr byte vxFanSpeeds[] PROGMEM = {
+  VX_FAN_SPEED_1,
+  VX_FAN_SPEED_2,
+  VX_FAN_SPEED_3,
+  VX_FAN_SPEED_4,
+  VX_FAN_SPEED_5,
+  VX_FAN_SPEED_6,
+  VX_FAN_SPEED_7,
+  VX_FAN_SPEED_8
+};
+
+// VX heating target (C) per fan speed bitmask
+constexpr int8_t vxHeatingTargets[] PROGMEM = {
+  10, 13, 15, 18, 20, 23, 25, 27
+};
+
+// VX NTC temperature conversion table
+constexpr int8_t vxTemps[] PROGMEM = {
+  -74, -70, -66, -62, -59, -56, -54, -52, -50, -48, // 0x00 - 0x09
+  -47, -46, -44, -43, -42, -41, -40, -39, -38, -37, // 0x0a - 0x13
+  -36, -35, -34, -33, -33, -32, -31, -30, -30, -29, // 0x14 - 0x1d
+  -28, -28, -27, -27, -26, -25, -25, -24, -24, -23, // 0x1e - 0x27
+  -23, -22, -22, -21, -21, -20, -20, -19, -19, -19, // 0x28 - 0x31
+  -18, -18, -17, -17, -16, -16, -16, -15, -15, -14, // 0x32 - 0x3b
+  -14, -14, -13, -13, -12, -12, -12, -11, -11, -11, // 0x3c - 0x45
+  -10, -10, -9, -9, -9, -8, -8, -8, -7, -7,         // 0x46 - 0x4f
+  -7, -6, -6, -6, -5, -5, -5, -4, -4, -4,           // 0x50 - 0x59
+  -3, -3, -3, -2, -2, -2, -1, -1, -1, -1,           // 0x5a - 0x63
+  0,  0,  0,  1,  1,  1,  2,  2,  2,  3,            // 0x64 - 0x6d
+  3,  3,  4,  4,  4,  5,  5,  5,  5,  6,            // 0x6e - 0x77
+  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,            // 0x78 - 0x81
+  9, 10, 10, 10, 11, 11, 11, 12, 12, 12,            // 0x82 - 0x8b
+  13, 13, 13, 14, 14, 14, 15, 15, 15, 16,           // 0x8c - 0x95
+  16, 16, 17, 17, 18, 18, 18, 19, 19, 19,           // 0x96 - 0x9f
+  20, 20, 21, 21, 21, 22, 22, 22, 23, 23,           // 0xa0 - 0xa9
+  24, 24, 24, 25, 25, 26, 26, 27, 27, 27,           // 0xaa - 0xb3
+  28, 28, 29, 29, 30, 30, 31, 31, 32, 32,           // 0xb4 - 0xbd
+  33, 33, 34, 34, 35, 35, 36, 36, 37, 37,           // 0xbe - 0xc7
+  38, 38, 39, 40, 40, 41, 41, 42, 43, 43,           // 0xc8 - 0xd1
+  44, 45, 45, 46, 47, 48, 48, 49, 50, 51,           // 0xd2 - 0xdb
+  52, 53, 53, 54, 55, 56, 57, 59, 60, 61,           // 0xdc - 0xe5
+  62, 63, 65, 66, 68, 69, 71, 73, 75, 77,           // 0xe6 - 0xef
+  79, 81, 82, 86, 90, 93, 97, 100, 100, 100,        // 0xf0 - 0xf9
+  100, 100, 100, 100, 100, 100                      // 0xfa - 0xff
+};
+
+static_assert(sizeof(vxTemps) == 256, "NTC table must cover all byte values");
+
+// table generators
+
+#define VX_TABLE_4(f, n) f(n), f(n + 1), f(n + 2), f(n + 3)
+#define VX_TABLE_16(f, n) VX_TABLE_4(f, n), VX_TABLE_4(f, n + 4), VX_TABLE_4(f, n + 8), VX_TABLE_4(f, n + 12)
+#define VX_TABLE_64(f, n) VX_TABLE_16(f, n), VX_TABLE_16(f, n + 16), VX_TABLE_16(f, n + 32), VX_TABLE_16(f, n + 48)
+#define VX_TABLE_256(f) VX_TABLE_64(f, 0), VX_TABLE_64(f, 64), VX_TABLE_64(f, 128), VX_TABLE_64(f, 192)
+
+// the NTC table has runs of equal temperatures, the true temperature
+// of a run is at its middle
+constexpr int vxRunStart(int ntc) {
+  return ntc > 0 && vxTemps[ntc - 1] == vxTemps[ntc] ? vxRunStart(ntc - 1) : ntc;
+}
+
+constexpr int vxRunEnd(int ntc) {
+  return ntc < 255 && vxTemps[ntc + 1] == vxTemps[ntc] ? vxRunEnd(ntc + 1) : ntc;
+}
+
+// twice the middle index of the run, to stay in integers
+constexpr int vxRunMiddle2(int ntc) {
+  return vxRunStart(ntc) + vxRunEnd(ntc);
+}
+
+// linear interpolation in 1/10 Cel between two run middles
+constexpr int vxLerpTenths(int cel0, int x0, int cel1, int x1, int x) {
+  return cel0 * 10 + ((cel1 - cel0) * 10 * (x - x0) + (x1 - x0) / 2) / (x1 - x0);
+}
+
+// the first and last runs are the sensor limits and are not interpolated
+constexpr int vxTempTenths(int ntc) {
+  return vxRunStart(ntc) == 0 || vxRunEnd(ntc) == 255 || 2 * ntc == vxRunMiddle2(ntc) ?
+         vxTemps[ntc] * 10 :
+         2 * ntc < vxRunMiddle2(ntc) ?
+         vxLerpTenths(vxTemps[vxRunStart(ntc) - 1], vxRunMiddle2(vxRunStart(ntc) - 1),
+                      vxTemps[ntc], vxRunMiddle2(ntc), 2 * ntc) :
+         vxLerpTenths(vxTemps[ntc], vxRunMiddle2(ntc),
+                      vxTemps[vxRunEnd(ntc) + 1], vxRunMiddle2(vxRunEnd(ntc) + 1), 2 * ntc);
+}
+
+// middle of the first run at or above the temperature
+constexpr int vxFirstNtcAbove(int cel, int ntc) {
+  return ntc >= 255 || vxTemps[ntc] >= cel ? ntc : vxFirstNtcAbove(cel, ntc + 1);
+}
+
+constexpr byte vxCelNtc(int index) {
+  return vxRunMiddle2(vxFirstNtcAbove(index + VX_NTC_MIN_CEL, 0)) / 2;
+}
+
+// fan speed 1-8 or 0 if hex is not a fan speed bitmask
+constexpr int8_t vxFanSpeedOf(int hex, int i) {
+  return i >= VX_MAX_FAN_SPEED ? 0 : vxFanSpeeds[i] == hex ? i + 1 : vxFanSpeedOf(hex, i + 1);
+}
+
+constexpr int8_t vxHexFanSpeed(int hex) {
+  return vxFanSpeedOf(hex, 0);
+}
+
+// RH % or -1 if hex is below the sensor range
+constexpr int8_t vxHexRh(int hex) {
+  return hex < 51 ? -1 : (hex - 51) * 100 / 204;
+}
+
+// smallest hex that reads back as the RH %
+constexpr byte vxRhHexOf(int rh, int hex) {
+  return hex >= 255 || vxHexRh(hex) >= rh ? hex : vxRhHexOf(rh, hex + 1);
+}
+
+constexpr byte vxRhHex(int rh) {
+  return vxRhHexOf(rh, 51);
+}
+
+// bitmask of the highest heating target not above the temperature
+constexpr byte vxHtHexOf(int cel, int i) {
+  return i + 1 < VX_MAX_FAN_SPEED && vxHeatingTargets[i + 1] <= cel ? vxHtHexOf(cel, i + 1) : vxFanSpeeds[i];
+}
+
+constexpr byte vxHtHex(int index) {
+  return vxHtHexOf(index + VX_MIN_HEATING_TARGET, 0);
+}
+
+// lookup tables
+
+const int16_t vxTempsTenths[256] PROGMEM = {
+  VX_TABLE_256(vxTempTenths)
+};
+
+const byte vxCelNtcs[VX_NTC_MAX_CEL - VX_NTC_MIN_CEL + 1] PROGMEM = {
+  VX_TABLE_64(vxCelNtc, 0), VX_TABLE_64(vxCelNtc, 64), VX_TABLE_16(vxCelNtc, 128),
+  VX_TABLE_16(vxCelNtc, 144), VX_TABLE_4(vxCelNtc, 160), VX_TABLE_4(vxCelNtc, 164),
+  VX_TABLE_4(vxCelNtc, 168), vxCelNtc(172), vxCelNtc(173), vxCelNtc(174)
+};
+
+const int8_t vxHexFanSpeeds[256] PROGMEM = {
+  VX_TABLE_256(vxHexFanSpeed)
+};
+
+const byte vxRhHexes[101] PROGMEM = {
+  VX_TABLE_64(vxRhHex, 0), VX_TABLE_16(vxRhHex, 64), VX_TABLE_16(vxRhHex, 80),
+  VX_TABLE_4(vxRhHex, 96), vxRhHex(100)
+};
+
+const byte vxHtHexes[VX_MAX_HEATING_TARGET - VX_MIN_HEATING_TARGET + 1] PROGMEM = {
+  VX_TABLE_16(vxHtHex, 0), vxHtHex(16), vxHtHex(17)
+};
+
+// conversions
+
+int vxNtc2Cel(byte ntc) {
+  return (int8_t)pgm_read_byte(&vxTemps[ntc]);
+}
+
+int vxNtc2CelTenths(byte ntc) {
+  return (int16_t)pgm_read_word(&vxTempsTenths[ntc]);
+}
+
+byte vxCel2Ntc(int cel) {
+  if (cel < VX_NTC_MIN_CEL || cel > VX_NTC_MAX_CEL) {
+    // we should not be here, return 10 Cel as default
+    return 0x83;
+  }
+
+  return pgm_read_byte(&vxCelNtcs[cel - VX_NTC_MIN_CEL]);
+}
+
+byte vxFanSpeed2Hex(int fan) {
+  if (fan >= VX_MIN_FAN_SPEED && fan <= VX_MAX_FAN_SPEED) {
+    return pgm_read_byte(&vxFanSpeeds[fan - 1]);
+  }
+
+  // we should not be here, return speed 1 as default
+  return VX_FAN_SPEED_1;
+}
+
+int vxHex2FanSpeed(byte hex) {
+  int8_t fan = pgm_read_byte(&vxHexFanSpeeds[hex]);
+  return fan > 0 ? fan : NOT_SET;
+}
+
+byte vxRh2Hex(int rh) {
+  if (rh < 0 || rh > 100) {
+    return 0x00;
+  }
+
+  return pgm_read_byte(&vxRhHexes[rh]);
+}
+
+int vxHex2HtCel(byte hex) {
+  int8_t fan = pgm_read_byte(&vxHexFanSpeeds[hex]);
+  return fan > 0 ? (int8_t)pgm_read_byte(&vxHeatingTargets[fan - 1]) : NOT_SET;
+}
+
+byte vxHtCel2Hex(int htCel) {
+  if (htCel < VX_MIN_HEATING_TARGET || htCel > VX_MAX_HEATING_TARGET) {
+    return VX_FAN_SPEED_1;
+  }
+
+  return pgm_read_byte(&vxHtHexes[htCel - VX_MIN_HEATING_TARGET]);
+}
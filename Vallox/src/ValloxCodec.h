@@ -0,0 +1,48 @@
+// =======================================
+// VALLOX DIGIT SE VALUE CONVERSIONS
+// =======================================
+
+#ifndef VALLOX_CODEC_H
+#define VALLOX_CODEC_H
+
+#include <Arduino.h>
+
+#define NOT_SET -999
+
+// fan speeds
+#define VX_FAN_SPEED_1 0x01
+#define VX_FAN_SPEED_2 0x03
+#define VX_FAN_SPEED_3 0x07
+#define VX_FAN_SPEED_4 0x0F
+#define VX_FAN_SPEED_5 0x1F
+#define VX_FAN_SPEED_6 0x3F
+#define VX_FAN_SPEED_7 0x7F
+#define VX_FAN_SPEED_8 0xFF
+#define VX_MIN_FAN_SPEED 1
+#define VX_MAX_FAN_SPEED 8
+
+// range of NTC temperatures
+#define VX_NTC_MIN_CEL -74
+#define VX_NTC_MAX_CEL 100
+
+// heating target range
+#define VX_MIN_HEATING_TARGET 10
+#define VX_MAX_HEATING_TARGET 27
+
+// all conversions but RH are single lookups to tables in flash
+// invalid input is returned as NOT_SET or converted to a safe default
+int vxNtc2Cel(byte ntc);
+int vxNtc2CelTenths(byte ntc); // interpolated, in 1/10 Cel
+byte vxCel2Ntc(int cel);
+byte vxFanSpeed2Hex(int fan);
+int vxHex2FanSpeed(byte hex);
+byte vxRh2Hex(int rh);
+int vxHex2HtCel(byte hex);
+byte vxHtCel2Hex(int htCel);
+
+// integer RH formula inline, cheaper than a call and a table read
+inline int vxHex2Rh(byte hex) {
+  return hex >= 51 ? (hex - 51) * 100 / 204 : NOT_SET;
+}
+
+#endif
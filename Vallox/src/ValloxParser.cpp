@@ -0,0 +1,90 @@
+// =======================================
+// VALLOX DIGIT SE MESSAGE PARSER
+// =======================================
+
+#include "Vallox.h"
+
+ValloxParser::ValloxParser() {
+}
+
+boolean ValloxParser::feed(byte b) {
+  window[length++] = b;
+
+  // resync until the bytes so far can start a message
+  while (length > 0 && !isValidPrefix()) {
+    shift();
+  }
+
+  if (length == VX_MSG_LENGTH) {
+    if (window[VX_MSG_LENGTH - 1] == Vallox::calculateCheckSum(window)) {
+      memcpy(message, window, VX_MSG_LENGTH);
+      length = 0;
+      accepted++;
+      return true;
+    }
+
+    // bad checksum, the message may start later in the window
+    corrupt++;
+    do {
+      shift();
+    } while (length > 0 && !isValidPrefix());
+  }
+
+  return false;
+}
+
+boolean ValloxParser::read(Stream* stream) {
+  while (stream->available() > 0) {
+    if (feed(stream->read())) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const byte* ValloxParser::getMessage() {
+  return message;
+}
+
+unsigned long ValloxParser::getAccepted() {
+  return accepted;
+}
+
+unsigned long ValloxParser::getCorrupt() {
+  return corrupt;
+}
+
+unsigned long ValloxParser::getDropped() {
+  return dropped;
+}
+
+void ValloxParser::resetCounters() {
+  accepted = 0;
+  corrupt = 0;
+  dropped = 0;
+}
+
+// domain first, then sender and receiver addresses
+boolean ValloxParser::isValidPrefix() {
+  if (window[0] != VX_MSG_DOMAIN) {
+    return false;
+  }
+
+  for (int i = 1; i < 3 && i < length; i++) {
+    if (window[i] < VX_MSG_MIN_ADDRESS || window[i] > VX_MSG_MAX_ADDRESS) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// drop the oldest byte
+void ValloxParser::shift() {
+  for (int i = 1; i < length; i++) {
+    window[i - 1] = window[i];
+  }
+  length--;
+  dropped++;
+}
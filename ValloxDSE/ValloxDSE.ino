@@ -25,7 +25,41 @@ NTPClient timeClient(ntpUDP, "pool.ntp.org");
 WiFiClientSecure espClient;
 PubSubClient client(AWS_endpoint, 8883, callback, espClient);
 Vallox vx(5, 4, DEBUG);
-unsigned long lastUpdated = 0;
+boolean publishAll = true; // full state on start and after failed writes
+
+// published values, only changed ones are sent after the first publish
+struct VxField {
+  byte variable;
+  const char* key;
+};
+
+const VxField vxFields[] = {
+  { VX_VARIABLE_T_INSIDE, "T_IN" },
+  { VX_VARIABLE_T_OUTSIDE, "T_OUT" },
+  { VX_VARIABLE_T_INCOMING, "T_INB" },
+  { VX_VARIABLE_T_EXHAUST, "T_OUTB" },
+  { VX_VARIABLE_RH, "RH" },
+  { VX_VARIABLE_FAN_SPEED, "SPEED" },
+  { VX_VARIABLE_DEFAULT_FAN_SPEED, "DEFAULT_SPEED" },
+  { VX_VARIABLE_SERVICE_PERIOD, "SERVICE_PERIOD" },
+  { VX_VARIABLE_SERVICE_COUNTER, "SERVICE_COUNTER" },
+  { VX_VARIABLE_HEATING_TARGET, "HEATING_TARGET" }
+};
+
+// published status flags of variable A3
+struct VxFlagField {
+  byte flag;
+  const char* key;
+};
+
+const VxFlagField vxFlagFields[] = {
+  { VX_STATUS_FLAG_POWER, "ON" },
+  { VX_STATUS_FLAG_RH, "RH_MODE" },
+  { VX_STATUS_FLAG_HEATING_MODE, "HEATING_MODE" },
+  { VX_STATUS_FLAG_HEATING, "HEATING" },
+  { VX_STATUS_FLAG_FAULT, "FAULT" },
+  { VX_STATUS_FLAG_SERVICE, "SERVICE" }
+};
 
 void setup() {
   Serial.begin(115200);
@@ -87,6 +121,7 @@ void setup() {
 
   Serial.print("Heap: "); Serial.println(ESP.getFreeHeap());
 
+  vx.setWriteCallback(writeDone);
   vx.init();
   
   Serial.println("Setup done");
@@ -102,11 +137,11 @@ void loop() {
   // loop VX messages
   vx.loop();
 
-  unsigned long newUpdate = vx.getUpdated();
-  if (lastUpdated != newUpdate) {
-    // data hash changed
-    if (publishData()) {
-      lastUpdated = newUpdate;
+  // publish only after the initial polls have completed
+  if (vx.isReady() && (publishAll || vx.hasChanges())) {
+    if (publishData(publishAll)) {
+      publishAll = false;
+      vx.clearChanged();
     }
   }
 }
@@ -167,30 +202,35 @@ void reconnect() {
   }
 }
 
-boolean publishData() {
+// publish all values or only the ones changed since the last publish
+boolean publishData(boolean all) {
   boolean ret = true;
 
   StaticJsonBuffer<JSON_BUFFER_LENGTH> jsonBuffer;
   JsonObject& root = jsonBuffer.createObject();
   JsonObject& d = root.createNestedObject("d");
 
-  d["T_IN"] = vx.getInsideTemp();
-  d["T_OUT"] = vx.getOutsideTemp();
-  d["T_INB"] = vx.getIncomingTemp();
-  d["T_OUTB"] = vx.getExhaustTemp();
-  d["ON"] = vx.isOn();
-  d["RH_MODE"] = vx.isRhMode();
-  d["RH"] = vx.getRh();
-  d["HEATING_MODE"] = vx.isHeatingMode();
-  d["SUMMER_MODE"] = vx.isSummerMode();
-  d["HEATING"] = vx.isHeating();
-  d["FAULT"] = vx.isFault();
-  d["SERVICE"] = vx.isServiceNeeded();
-  d["SPEED"] = vx.getFanSpeed();
-  d["DEFAULT_SPEED"] = vx.getDefaultFanSpeed();
-  d["SERVICE_PERIOD"] = vx.getServicePeriod();
-  d["SERVICE_COUNTER"] = vx.getServiceCounter();
-  d["HEATING_TARGET"] = vx.getHeatingTarget();
+  for (const VxField& field : vxFields) {
+    if (all || vx.isChanged(field.variable)) {
+      d[field.key] = vx.getValue(field.variable);
+    }
+  }
+
+  byte changedFlags = all ? 0xFF : vx.getChangedStatusFlags();
+  for (const VxFlagField& field : vxFlagFields) {
+    if (changedFlags & field.flag) {
+      d[field.key] = vx.isStatusFlag(field.flag);
+    }
+  }
+
+  if (all || vx.isChanged(VX_VARIABLE_IO_08)) {
+    d["SUMMER_MODE"] = vx.isSummerMode();
+  }
+
+  if (d.size() == 0) {
+    // changes in variables that are not published
+    return true;
+  }
 
   if (DEBUG) {
     Serial.println("Publish payload:"); root.prettyPrintTo(Serial); Serial.println();
@@ -211,6 +251,14 @@ boolean publishData() {
   return ret;
 }
 
+// a write that did not stick leaves the published state stale
+void writeDone(byte mainboard, byte variable, byte value, boolean success) {
+  if (!success) {
+    Serial.print("Vallox write failed, variable "); Serial.println(variable, HEX);
+    publishAll = true;
+  }
+}
+
 void callback(char* topic, byte * payload, unsigned int length) {
   if (DEBUG) {
     Serial.print("Callback invoked for topic: "); Serial.println(topic);
@@ -233,6 +281,7 @@ void handleUpdate(byte * payload) {
     Serial.println("handleUpdate payload:"); root.prettyPrintTo(Serial); Serial.println();
   }
 
+  // status flag changes are written together by the next vx.loop()
   JsonObject& d = root["d"];
   if (d.containsKey("ON")) {
     boolean isOn = d["ON"];